@@ -0,0 +1,93 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+/*
+ * Checks that binary mode frames survive COBS encoding: every block decodes
+ * back to itself, the encoded form has no zero bytes and fits in
+ * COBS_MAX_ENCODED(), and malformed input is rejected.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cobs.h"
+
+// Longest block checked. Runs of 254 non-zero bytes are where COBS changes
+// how it encodes, so this covers a few of them.
+#define MAX_LEN (1024)
+
+static int failures = 0;
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      ++failures;                                                     \
+    }                                                                 \
+  } while (0)
+
+/*
+ * Encode a block, check the encoded form, and decode it again both into a
+ * separate buffer and in place.
+ */
+static void round_trip(const uint8_t* data, size_t len) {
+  static uint8_t encoded[COBS_MAX_ENCODED(MAX_LEN)];
+  static uint8_t decoded[COBS_MAX_ENCODED(MAX_LEN)];
+  size_t decoded_len;
+
+  size_t n = cobs_encode(data, len, encoded);
+  CHECK(n <= COBS_MAX_ENCODED(len));
+  CHECK(memchr(encoded, 0, n) == NULL);
+
+  CHECK(cobs_decode(encoded, n, decoded, &decoded_len));
+  CHECK(decoded_len == len && memcmp(decoded, data, len) == 0);
+
+  CHECK(cobs_decode(encoded, n, encoded, &decoded_len));
+  CHECK(decoded_len == len && memcmp(encoded, data, len) == 0);
+}
+
+int main(void) {
+  static uint8_t data[MAX_LEN];
+  uint32_t seed = 1;
+
+  // All zeros, no zeros at all, and a mix, at every length.
+  for (size_t len = 0; len <= MAX_LEN; ++len) {
+    memset(data, 0, len);
+    round_trip(data, len);
+
+    memset(data, 0x5A, len);
+    round_trip(data, len);
+
+    for (size_t i = 0; i < len; ++i) {
+      seed = seed * 1103515245u + 12345u;
+      data[i] = (seed >> 16) % 4 == 0 ? 0 : seed >> 24;
+    }
+    round_trip(data, len);
+  }
+
+  // A code byte that points past the end, and a zero code byte.
+  static const uint8_t truncated[] = {0x05, 0x01, 0x02};
+  static const uint8_t zero_code[] = {0x02, 0x01, 0x00};
+  uint8_t out[sizeof(truncated)];
+  size_t out_len;
+  CHECK(!cobs_decode(truncated, sizeof(truncated), out, &out_len));
+  CHECK(!cobs_decode(zero_code, sizeof(zero_code), out, &out_len));
+
+  if (failures > 0) {
+    printf("%d checks failed\n", failures);
+    return EXIT_FAILURE;
+  }
+
+  printf("all checks passed\n");
+  return EXIT_SUCCESS;
+}
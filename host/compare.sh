@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Run the same commands through the simulator built from another revision of
+# the firmware and from the working tree, and show any differences in what
+# they send back.
+#
+# usage: host/compare.sh <revision> [commands file]
+#
+# The commands file has one command per line (host/commands.txt by default).
+# Each run starts with blank flash.
+
+set -e
+
+host=$(cd "$(dirname "$0")" && pwd)
+repo=$(cd "$host/.." && pwd)
+rev=${1:?usage: $0 <revision> [commands file]}
+commands=${2:-$host/commands.txt}
+work=$(mktemp -d)
+
+cleanup() {
+  git -C "$repo" worktree remove --force "$work/old" >/dev/null 2>&1 || true
+  rm -rf "$work"
+}
+trap cleanup EXIT
+
+git -C "$repo" worktree add --detach "$work/old" "$rev" >/dev/null 2>&1
+
+for side in old new; do
+  if [ "$side" = old ]; then src="$work/old/src"; else src="$repo/src"; fi
+  cmake -S "$host" -B "$work/$side-build" -DFIRMWARE_SRC="$src" >/dev/null
+  cmake --build "$work/$side-build" --target pico-ident-sim >/dev/null
+  tr '\n' '\r' <"$commands" | "$work/$side-build/pico-ident-sim" \
+    >"$work/$side.txt"
+done
+
+if diff -u --label "$rev" --label "working tree" "$work/old.txt" \
+    "$work/new.txt"; then
+  echo "no differences"
+else
+  exit 1
+fi
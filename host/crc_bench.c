@@ -0,0 +1,177 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+/*
+ * Microbenchmark for the device info checksum. This times the original 8-bit
+ * additive byte loop and a bitwise CRC-32 byte loop against the full crc32()
+ * kernel and against crc32_update() for a write to a single field. On the host,
+ * crc32() is the table-driven version rather than the DMA sniffer.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crc.h"
+
+// Layout of the device info fields: 10 fields of 64 bytes each.
+#define FIELD_COUNT (10)
+#define FIELD_SIZE (64)
+#define INFO_SIZE (FIELD_COUNT * FIELD_SIZE)
+
+#define ITERATIONS (200000)
+
+static uint8_t info[INFO_SIZE];
+
+// Keeps the compiler from dropping the loops being timed.
+static volatile uint32_t sink;
+
+/*
+ * The checksum used by the original firmware: an 8-bit sum of every byte.
+ */
+static uint8_t sum8(const uint8_t* data, size_t len) {
+  uint8_t sum = 0;
+
+  for (size_t i = 0; i < len; ++i) {
+    sum += data[i];
+  }
+
+  return sum;
+}
+
+/*
+ * CRC-32 computed a bit at a time, as a plain byte loop would.
+ */
+static uint32_t crc32_bitwise(const uint8_t* data, size_t len) {
+  uint32_t crc = 0xFFFFFFFFu;
+
+  for (size_t i = 0; i < len; ++i) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320u : 0);
+    }
+  }
+
+  return ~crc;
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char* name, double start) {
+  printf("%-24s %8.1f ns/op\n", name, (now_ns() - start) / ITERATIONS);
+}
+
+// Fill a field with a new value, as a write command would.
+static void write_field(size_t field, uint32_t n) {
+  uint8_t* dst = info + field * FIELD_SIZE;
+  memset(dst, 0, FIELD_SIZE);
+  snprintf((char*)dst, FIELD_SIZE, "value %lu", (unsigned long)n);
+}
+
+/*
+ * Make sure the kernels agree before timing them.
+ */
+static bool check(void) {
+  for (size_t i = 0; i < INFO_SIZE; ++i) {
+    info[i] = (uint8_t)rand();
+  }
+
+  uint32_t crc = crc32(info, INFO_SIZE);
+  if (crc != crc32_bitwise(info, INFO_SIZE)) {
+    fprintf(stderr, "crc32() doesn't match the bitwise CRC-32\n");
+    return false;
+  }
+
+  for (size_t field = 0; field < FIELD_COUNT; ++field) {
+    uint8_t delta[FIELD_SIZE];
+    memcpy(delta, info + field * FIELD_SIZE, FIELD_SIZE);
+    write_field(field, field);
+    for (size_t i = 0; i < FIELD_SIZE; ++i) {
+      delta[i] ^= info[field * FIELD_SIZE + i];
+    }
+
+    size_t after = INFO_SIZE - (field + 1) * FIELD_SIZE;
+    crc = crc32_update(crc, delta, FIELD_SIZE, after);
+    if (crc != crc32(info, INFO_SIZE)) {
+      fprintf(stderr, "crc32_update() is wrong for field %zu\n", field);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int main(void) {
+  if (!check()) return EXIT_FAILURE;
+
+  printf("%d-byte record, %d iterations\n", INFO_SIZE, ITERATIONS);
+
+  double start = now_ns();
+  for (uint32_t i = 0; i < ITERATIONS; ++i) {
+    info[0] = (uint8_t)i;
+    sink = sum8(info, INFO_SIZE);
+  }
+  report("sum8 byte loop", start);
+
+  start = now_ns();
+  for (uint32_t i = 0; i < ITERATIONS; ++i) {
+    info[0] = (uint8_t)i;
+    sink = crc32_bitwise(info, INFO_SIZE);
+  }
+  report("crc32 byte loop", start);
+
+  start = now_ns();
+  for (uint32_t i = 0; i < ITERATIONS; ++i) {
+    info[0] = (uint8_t)i;
+    sink = crc32(info, INFO_SIZE);
+  }
+  report("crc32 full", start);
+
+  // A field write followed by a full recompute, which is what the firmware did
+  // before crc32_update().
+  start = now_ns();
+  for (uint32_t i = 0; i < ITERATIONS; ++i) {
+    write_field(i % FIELD_COUNT, i);
+    sink = crc32(info, INFO_SIZE);
+  }
+  report("write + crc32 full", start);
+
+  // The same write, updating the CRC from the field's delta instead. The field
+  // moves around so the cached factors get exercised too.
+  uint32_t crc = crc32(info, INFO_SIZE);
+  start = now_ns();
+  for (uint32_t i = 0; i < ITERATIONS; ++i) {
+    size_t field = i % FIELD_COUNT;
+    uint8_t delta[FIELD_SIZE];
+    memcpy(delta, info + field * FIELD_SIZE, FIELD_SIZE);
+    write_field(field, i);
+    for (size_t j = 0; j < FIELD_SIZE; ++j) {
+      delta[j] ^= info[field * FIELD_SIZE + j];
+    }
+    crc = crc32_update(crc, delta, FIELD_SIZE,
+                       INFO_SIZE - (field + 1) * FIELD_SIZE);
+  }
+  report("write + crc32_update", start);
+  sink = crc;
+
+  if (crc != crc32(info, INFO_SIZE)) {
+    fprintf(stderr, "crc32_update() drifted from crc32()\n");
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,102 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+/*
+ * Benchmark for command dispatch. For every field and command, this times the
+ * trie lookup the firmware uses against the chain of strncmp() calls it
+ * replaced, which tried the fields (checking for both '=' and '?') and then
+ * each command in turn.
+ *
+ * The firmware's main.c is included directly so that its tables and lookup
+ * functions can be used as they are.
+ */
+
+#include <time.h>
+
+#define main firmware_main
+#include "main.c"
+#undef main
+
+#define ITERATIONS (1000000)
+
+// Keeps the compiler from dropping the loops being timed.
+static volatile int sink;
+
+/*
+ * Look up a message the way handle_msg() used to: the fields first, which only
+ * match if the name is followed by '=' or '?', then the commands in order.
+ */
+static int strncmp_lookup(const char* msg) {
+  for (size_t i = 0; i < count_of(fields); ++i) {
+    if (strncmp(msg, fields[i].name, fields[i].name_len) != 0) continue;
+
+    char c = msg[fields[i].name_len];
+    if (c == '=' || c == '?') return i;
+  }
+
+  for (size_t i = 0; i < count_of(commands); ++i) {
+    if (strncmp(msg, commands[i].name, strlen(commands[i].name)) == 0) {
+      return count_of(fields) + i;
+    }
+  }
+
+  return -1;
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Time one message through both lookups, adding the results to the totals.
+static void bench(const char* msg, double* trie_total, double* chain_total) {
+  size_t len;
+
+  double start = now_ns();
+  for (int i = 0; i < ITERATIONS; ++i) {
+    sink = find_command(msg, &len);
+  }
+  double trie_ns = (now_ns() - start) / ITERATIONS;
+
+  start = now_ns();
+  for (int i = 0; i < ITERATIONS; ++i) {
+    sink = strncmp_lookup(msg);
+  }
+  double chain_ns = (now_ns() - start) / ITERATIONS;
+
+  printf("%-16s %8.1f %8.1f\n", msg, trie_ns, chain_ns);
+  *trie_total += trie_ns;
+  *chain_total += chain_ns;
+}
+
+int main(void) {
+  char msg[32];
+  double trie_total = 0;
+  double chain_total = 0;
+  size_t n = 0;
+
+  init_commands();
+
+  printf("%-16s %8s %8s  (ns per lookup)\n", "message", "trie", "strncmp");
+
+  for (size_t i = 0; i < count_of(fields); ++i, ++n) {
+    snprintf(msg, sizeof(msg), "%s?", fields[i].name);
+    bench(msg, &trie_total, &chain_total);
+  }
+  for (size_t i = 0; i < count_of(commands); ++i, ++n) {
+    snprintf(msg, sizeof(msg), "%s?", commands[i].name);
+    bench(msg, &trie_total, &chain_total);
+  }
+
+  printf("%-16s %8.1f %8.1f\n", "average", trie_total / n, chain_total / n);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,24 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+#ifndef PICO_IDENT_HOST_HARDWARE_FLASH_H
+#define PICO_IDENT_HOST_HARDWARE_FLASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FLASH_PAGE_SIZE (1u << 8)
+#define FLASH_SECTOR_SIZE (1u << 12)
+
+void flash_range_erase(uint32_t flash_offs, size_t count);
+void flash_range_program(uint32_t flash_offs, const uint8_t* data,
+                         size_t count);
+
+#endif  // PICO_IDENT_HOST_HARDWARE_FLASH_H
@@ -0,0 +1,25 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+#ifndef PICO_IDENT_HOST_HARDWARE_GPIO_H
+#define PICO_IDENT_HOST_HARDWARE_GPIO_H
+
+#include "pico/stdlib.h"
+
+#define GPIO_IN (false)
+#define GPIO_OUT (true)
+
+void gpio_init(uint gpio);
+void gpio_set_dir(uint gpio, bool out);
+void gpio_put(uint gpio, bool value);
+bool gpio_get(uint gpio);
+void gpio_pull_down(uint gpio);
+
+#endif  // PICO_IDENT_HOST_HARDWARE_GPIO_H
@@ -0,0 +1,21 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+#ifndef PICO_IDENT_HOST_PICO_BINARY_INFO_H
+#define PICO_IDENT_HOST_PICO_BINARY_INFO_H
+
+// There's nowhere to put binary info on the host, so it's all dropped.
+#define bi_decl(...)
+#define BINARY_INFO_MAKE_TAG(a, b) (0)
+#define BINARY_INFO_BLOCK_DEV_FLAG_READ (1)
+#define BINARY_INFO_BLOCK_DEV_FLAG_WRITE (2)
+#define BINARY_INFO_BLOCK_DEV_FLAG_PT_UNKNOWN (4)
+
+#endif  // PICO_IDENT_HOST_PICO_BINARY_INFO_H
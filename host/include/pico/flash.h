@@ -0,0 +1,19 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+#ifndef PICO_IDENT_HOST_PICO_FLASH_H
+#define PICO_IDENT_HOST_PICO_FLASH_H
+
+#include "hardware/flash.h"
+#include "pico/stdlib.h"
+
+int flash_safe_execute(void (*func)(void*), void* param, uint32_t timeout_ms);
+
+#endif  // PICO_IDENT_HOST_PICO_FLASH_H
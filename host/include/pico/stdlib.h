@@ -0,0 +1,61 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+/*
+ * Just enough of the Pico SDK's pico/stdlib.h to build the firmware sources on
+ * a host machine. The functions are implemented by sim.c.
+ */
+
+#ifndef PICO_IDENT_HOST_PICO_STDLIB_H
+#define PICO_IDENT_HOST_PICO_STDLIB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define PICO_ON_DEVICE (0)
+
+#define PICO_OK (0)
+#define PICO_ERROR_TIMEOUT (-1)
+
+#define NUM_CORES (2)
+
+#define PICO_FLASH_SIZE_BYTES (2 * 1024 * 1024)
+
+// The simulated flash, which the firmware reads through XIP_BASE like the real
+// one.
+extern uint8_t sim_flash[PICO_FLASH_SIZE_BYTES];
+#define XIP_BASE ((uintptr_t)sim_flash)
+
+#define count_of(a) (sizeof(a) / sizeof((a)[0]))
+
+typedef unsigned int uint;
+
+typedef uint64_t absolute_time_t;
+
+absolute_time_t get_absolute_time(void);
+
+static inline uint64_t to_us_since_boot(absolute_time_t t) { return t; }
+
+static inline int64_t absolute_time_diff_us(absolute_time_t from,
+                                            absolute_time_t to) {
+  return (int64_t)(to - from);
+}
+
+// Everything runs on a single thread, standing in for core0.
+static inline uint get_core_num(void) { return 0; }
+
+bool stdio_init_all(void);
+int getchar_timeout_us(uint32_t timeout_us);
+int putchar_raw(int c);
+void stdio_flush(void);
+
+#endif  // PICO_IDENT_HOST_PICO_STDLIB_H
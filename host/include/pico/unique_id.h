@@ -0,0 +1,20 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+#ifndef PICO_IDENT_HOST_PICO_UNIQUE_ID_H
+#define PICO_IDENT_HOST_PICO_UNIQUE_ID_H
+
+#include "pico/stdlib.h"
+
+#define PICO_UNIQUE_BOARD_ID_SIZE_BYTES (8)
+
+void pico_get_unique_board_id_string(char* id_out, uint len);
+
+#endif  // PICO_IDENT_HOST_PICO_UNIQUE_ID_H
@@ -0,0 +1,167 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+/*
+ * Stand-ins for the parts of the Pico SDK the firmware uses, so that it can run
+ * on a host machine. The serial port is stdin and stdout, and the flash is an
+ * array in RAM.
+ *
+ * Environment variables:
+ *  SIM_FLASH   file to load the flash from, and save it to after every change
+ *  SIM_WRLOCK  if set, the write lock is asserted
+ */
+
+#include <assert.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hardware/flash.h"
+#include "hardware/gpio.h"
+#include "pico/flash.h"
+#include "pico/stdlib.h"
+#include "pico/unique_id.h"
+
+// How long to keep running once stdin is closed, so that pending changes get
+// committed before exiting.
+#define EXIT_DELAY_US (200 * 1000)
+
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+uint8_t sim_flash[PICO_FLASH_SIZE_BYTES] __attribute__((aligned(4096)));
+
+// The linker defines these for the firmware. Here, the program takes up the
+// first 64K of flash, and the storage partition is at the end.
+__asm__(".globl __storage_start\n"
+        ".set __storage_start, sim_flash + " XSTR(PICO_FLASH_SIZE_BYTES) " - "
+        XSTR(STORAGE_SIZE) "\n"
+        ".globl __flash_binary_end\n"
+        ".set __flash_binary_end, sim_flash + 0x10000\n");
+
+static const char* flash_file;
+
+static uint64_t start_us;
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static void save_flash(void) {
+  if (flash_file == NULL) return;
+
+  FILE* f = fopen(flash_file, "wb");
+  if (f != NULL) {
+    fwrite(sim_flash, 1, sizeof(sim_flash), f);
+    fclose(f);
+  }
+}
+
+bool stdio_init_all(void) {
+  start_us = now_us();
+
+  memset(sim_flash, 0xFF, sizeof(sim_flash));
+  flash_file = getenv("SIM_FLASH");
+  if (flash_file != NULL) {
+    FILE* f = fopen(flash_file, "rb");
+    if (f != NULL) {
+      size_t n = fread(sim_flash, 1, sizeof(sim_flash), f);
+      (void)n;
+      fclose(f);
+    }
+  }
+
+  return true;
+}
+
+int getchar_timeout_us(uint32_t timeout_us) {
+  static uint64_t eof_us = 0;
+  unsigned char c;
+
+  if (eof_us == 0) {
+    struct pollfd fd = {.fd = STDIN_FILENO, .events = POLLIN};
+    if (poll(&fd, 1, (timeout_us + 999) / 1000) > 0) {
+      if (read(STDIN_FILENO, &c, 1) == 1) return c;
+      eof_us = now_us();
+    }
+    return PICO_ERROR_TIMEOUT;
+  }
+
+  // Once stdin is closed, stay idle for a while, then stop.
+  if (now_us() - eof_us >= EXIT_DELAY_US) {
+    fflush(stdout);
+    exit(EXIT_SUCCESS);
+  }
+  usleep(timeout_us);
+  return PICO_ERROR_TIMEOUT;
+}
+
+// There's no CR/LF translation on the host, so this is the same as putchar().
+int putchar_raw(int c) { return putchar(c); }
+
+void stdio_flush(void) { fflush(stdout); }
+
+absolute_time_t get_absolute_time(void) { return now_us() - start_us; }
+
+void flash_range_erase(uint32_t flash_offs, size_t count) {
+  assert(flash_offs % FLASH_SECTOR_SIZE == 0);
+  assert(count % FLASH_SECTOR_SIZE == 0);
+  assert(flash_offs + count <= sizeof(sim_flash));
+
+  memset(sim_flash + flash_offs, 0xFF, count);
+  save_flash();
+}
+
+void flash_range_program(uint32_t flash_offs, const uint8_t* data,
+                         size_t count) {
+  assert(flash_offs % FLASH_PAGE_SIZE == 0);
+  assert(count % FLASH_PAGE_SIZE == 0);
+  assert(flash_offs + count <= sizeof(sim_flash));
+
+  // Programming can only clear bits.
+  for (size_t i = 0; i < count; ++i) {
+    sim_flash[flash_offs + i] &= data[i];
+  }
+  save_flash();
+}
+
+int flash_safe_execute(void (*func)(void*), void* param, uint32_t timeout_ms) {
+  (void)timeout_ms;
+  func(param);
+  return PICO_OK;
+}
+
+void gpio_init(uint gpio) { (void)gpio; }
+
+void gpio_set_dir(uint gpio, bool out) {
+  (void)gpio;
+  (void)out;
+}
+
+void gpio_put(uint gpio, bool value) {
+  (void)gpio;
+  (void)value;
+}
+
+// The write lock input is the only pin that's read.
+bool gpio_get(uint gpio) {
+  (void)gpio;
+  return getenv("SIM_WRLOCK") != NULL;
+}
+
+void gpio_pull_down(uint gpio) { (void)gpio; }
+
+void pico_get_unique_board_id_string(char* id_out, uint len) {
+  snprintf(id_out, len, "E66038B7137A2C2F");
+}
@@ -0,0 +1,202 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+/*
+ * Checks for how the storage code recovers from damage and interruptions: bit
+ * errors corrected by the ECC, a journal write torn by a power cut, and a blob
+ * upload resumed after a reset. Damage is made directly in the simulated flash,
+ * and a reset is simulated by running the init functions again.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blob.h"
+#include "crc.h"
+#include "ecc.h"
+#include "journal.h"
+#include "pico/stdlib.h"
+#include "storage.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      ++failures;                                                     \
+    }                                                                 \
+  } while (0)
+
+// Erase all of the simulated flash and start over as if the device were new.
+static void reset_flash(void) {
+  memset(sim_flash, 0xFF, sizeof(sim_flash));
+  storage_init();
+}
+
+// Flip a bit in flash without going through the storage code.
+static void flip_bit(const void* ptr, unsigned bit) {
+  ((uint8_t*)ptr)[bit / 8] ^= 1u << (bit % 8);
+}
+
+// Fill a buffer with bytes that aren't all the same.
+static void fill(uint8_t* buf, size_t len, uint32_t seed) {
+  for (size_t i = 0; i < len; ++i) {
+    seed = seed * 1103515245u + 12345u;
+    buf[i] = seed >> 24;
+  }
+}
+
+/*
+ * Every single-bit error in the data or check bytes is corrected, including in
+ * a partial last word, and a double-bit error in one word is reported.
+ */
+static void check_ecc(void) {
+  uint8_t data[63];
+  uint8_t copy[sizeof(data)];
+  uint8_t check[ECC_CHECK_SIZE(sizeof(data))];
+  uint8_t bad_check[sizeof(check)];
+
+  fill(data, sizeof(data), 1);
+  ecc_encode(data, sizeof(data), check);
+
+  memcpy(copy, data, sizeof(data));
+  CHECK(ecc_correct(copy, sizeof(copy), check) == ECC_OK);
+
+  for (unsigned bit = 0; bit < sizeof(data) * 8; ++bit) {
+    memcpy(copy, data, sizeof(data));
+    flip_bit(copy, bit);
+    CHECK(ecc_correct(copy, sizeof(copy), check) == ECC_CORRECTED);
+    CHECK(memcmp(copy, data, sizeof(data)) == 0);
+  }
+
+  // The top bit of each check byte isn't used.
+  for (unsigned bit = 0; bit < sizeof(check) * 8; ++bit) {
+    if (bit % 8 == 7) continue;
+
+    memcpy(copy, data, sizeof(data));
+    memcpy(bad_check, check, sizeof(check));
+    flip_bit(bad_check, bit);
+    CHECK(ecc_correct(copy, sizeof(copy), bad_check) == ECC_CORRECTED);
+    CHECK(memcmp(copy, data, sizeof(data)) == 0);
+  }
+
+  memcpy(copy, data, sizeof(data));
+  flip_bit(copy, 8);
+  flip_bit(copy, 21);
+  CHECK(ecc_correct(copy, sizeof(copy), check) == ECC_FAILED);
+}
+
+/*
+ * A record whose commit byte was never programmed is ignored, and the one
+ * before it is still the newest. A bit error in the newest header is corrected
+ * and reported so that the record gets written again.
+ */
+static void check_journal(void) {
+  struct journal j = JOURNAL(0, JOURNAL_SECTORS);
+  const char* records[] = {"first", "second", "third"};
+  size_t len;
+
+  reset_flash();
+  journal_init(&j);
+  CHECK(journal_latest(&j, &len) == NULL);
+
+  for (size_t i = 0; i < count_of(records); ++i) {
+    CHECK(journal_append(&j, records[i], strlen(records[i])));
+  }
+
+  // The commit byte is the last byte of the header, right before the data.
+  const uint8_t* latest = journal_latest(&j, &len);
+  ((uint8_t*)latest)[-1] = 0xFF;
+
+  journal_init(&j);
+  latest = journal_latest(&j, &len);
+  CHECK(latest != NULL && len == strlen(records[1]) &&
+        memcmp(latest, records[1], len) == 0);
+  CHECK(journal_health(&j) == ECC_OK);
+
+  // The next record goes after the torn one, and replaces it as the newest.
+  CHECK(journal_append(&j, "fourth", 6));
+  journal_init(&j);
+  latest = journal_latest(&j, &len);
+  CHECK(latest != NULL && len == 6 && memcmp(latest, "fourth", 6) == 0);
+
+  // Flip a bit in the sequence number of the newest header.
+  flip_bit((const uint8_t*)latest - 12, 3);
+  journal_init(&j);
+  latest = journal_latest(&j, &len);
+  CHECK(latest != NULL && len == 6 && memcmp(latest, "fourth", 6) == 0);
+  CHECK(journal_health(&j) == ECC_CORRECTED);
+}
+
+/*
+ * An upload interrupted by a reset picks up from the last page that was
+ * programmed, and the finished blob matches what was sent.
+ */
+static void check_blob(void) {
+  static uint8_t data[3000];
+  size_t received;
+  size_t size;
+  uint32_t crc;
+
+  fill(data, sizeof(data), 2);
+  uint32_t data_crc = crc32(data, sizeof(data));
+
+  reset_flash();
+  blob_init();
+  CHECK(!blob_info(&size, &crc));
+
+  CHECK(blob_begin(sizeof(data), data_crc));
+  for (size_t pos = 0; pos < 1000; pos += 200) {
+    CHECK(blob_write(pos, data + pos, 200));
+  }
+
+  // Only whole pages were programmed, so the rest of the last one is lost.
+  storage_init();
+  blob_init();
+  CHECK(blob_upload_status(&received, &size) == BLOB_UPLOAD_ACTIVE);
+  CHECK(received == 1000 - 1000 % FLASH_PAGE_SIZE && size == sizeof(data));
+  CHECK(!blob_info(&size, &crc));
+
+  // Starting the same upload again resumes it.
+  CHECK(blob_begin(sizeof(data), data_crc));
+  CHECK(blob_upload_status(&received, &size) == BLOB_UPLOAD_ACTIVE);
+  CHECK(received == 1000 - 1000 % FLASH_PAGE_SIZE);
+  CHECK(blob_write(received, data + received, sizeof(data) - received));
+  CHECK(blob_upload_status(&received, &size) == BLOB_UPLOAD_NONE);
+
+  storage_init();
+  blob_init();
+  CHECK(blob_info(&size, &crc) && size == sizeof(data) && crc == data_crc);
+  for (size_t pos = 0; pos < sizeof(data);) {
+    size_t len = sizeof(data) - pos;
+    const uint8_t* chunk = blob_read(pos, &len);
+    CHECK(chunk != NULL && memcmp(chunk, data + pos, len) == 0);
+    if (chunk == NULL) break;
+    pos += len;
+  }
+}
+
+int main(void) {
+  check_ecc();
+  check_journal();
+  check_blob();
+
+  if (failures > 0) {
+    printf("%d checks failed\n", failures);
+    return EXIT_FAILURE;
+  }
+
+  printf("all checks passed\n");
+  return EXIT_SUCCESS;
+}
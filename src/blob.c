@@ -0,0 +1,323 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+#include "blob.h"
+
+#include <string.h>
+
+#include "crc.h"
+#include "pico/stdlib.h"
+#include "storage.h"
+
+#define BLOB_MAGIC (0x424C4F42u)
+
+// Number of pages of blob data in a region.
+#define BLOB_PAGES (BLOB_MAX_SIZE / FLASH_PAGE_SIZE)
+
+#define REGION_SIZE (BLOB_SECTORS * FLASH_SECTOR_SIZE)
+
+_Static_assert(JOURNAL_SECTORS + KV_SECTORS + 2 * BLOB_SECTORS <=
+                   STORAGE_SECTORS,
+               "the blob regions don't fit in STORAGE_SIZE");
+
+/*
+ * Header in the first page of each region.
+ */
+struct blob_header {
+  uint32_t magic;
+  // Sequence number, incremented for each upload.
+  uint32_t seq;
+  // Size and CRC-32 of the blob.
+  uint32_t size;
+  uint32_t crc;
+  // Check value computed from the fields above, programmed along with them.
+  uint32_t check;
+  // Commit tag, programmed once the whole blob has been written and its CRC-32
+  // checked. Only a region with a valid tag holds a usable blob.
+  uint32_t tag;
+  // One bit per page of blob data, cleared once that page has been programmed.
+  // This lets an upload be resumed after a reset.
+  uint8_t pages[(BLOB_PAGES + 7) / 8];
+};
+
+_Static_assert(sizeof(struct blob_header) <= FLASH_PAGE_SIZE,
+               "blob header doesn't fit in a page");
+
+// Region holding the stored blob, or NO_REGION if there isn't one.
+#define NO_REGION (-1)
+static int active = NO_REGION;
+
+// Region being uploaded to, or NO_REGION if there's no upload.
+static int upload = NO_REGION;
+static enum blob_upload_state upload_state = BLOB_UPLOAD_NONE;
+static size_t received = 0;
+
+// Staging buffer for the page currently being received. Each page is
+// programmed from here as soon as it's complete.
+static uint8_t stage[FLASH_PAGE_SIZE] __attribute__((aligned(4)));
+
+static uint32_t region_offset(int region) {
+  return BLOB_OFFSET + region * REGION_SIZE;
+}
+
+// Offset of a page of blob data in a region.
+static uint32_t data_offset(int region, uint32_t page) {
+  return region_offset(region) + (page + 1) * FLASH_PAGE_SIZE;
+}
+
+static const struct blob_header* header(int region) {
+  return storage_ptr(region_offset(region));
+}
+
+static uint32_t header_check(const struct blob_header* hdr) {
+  return crc32_tag(hdr, offsetof(struct blob_header, check));
+}
+
+// The tag covers everything before it, including the check value.
+static uint32_t header_tag(const struct blob_header* hdr) {
+  return crc32_tag(hdr, offsetof(struct blob_header, tag));
+}
+
+// Check whether a region's header was completely written.
+static bool is_started(int region) {
+  const struct blob_header* hdr = header(region);
+  return hdr->magic == BLOB_MAGIC && hdr->check == header_check(hdr) &&
+         hdr->size <= BLOB_MAX_SIZE;
+}
+
+static bool is_committed(int region) {
+  const struct blob_header* hdr = header(region);
+  return is_started(region) && hdr->tag == header_tag(hdr);
+}
+
+// Count the pages of a region that have been programmed, in order.
+static uint32_t pages_done(int region) {
+  const struct blob_header* hdr = header(region);
+  uint32_t page = 0;
+  while (page < BLOB_PAGES && !(hdr->pages[page / 8] & (1u << (page % 8)))) {
+    ++page;
+  }
+  return page;
+}
+
+// Compute the CRC-32 of the blob in a region one sector at a time, since the
+// region's sectors aren't necessarily contiguous in flash.
+static uint32_t region_crc(int region, size_t size) {
+  uint32_t crc = 0;
+  size_t pos = 0;
+
+  while (pos < size) {
+    uint32_t offset = data_offset(region, 0) + pos;
+    size_t n = FLASH_SECTOR_SIZE - offset % FLASH_SECTOR_SIZE;
+    if (n > size - pos) n = size - pos;
+
+    crc = crc32_combine(crc, crc32(storage_ptr(offset), n), n);
+    pos += n;
+  }
+
+  return crc;
+}
+
+// Program the page in the staging buffer and mark it as done.
+static bool program_stage(uint32_t page) {
+  const uint8_t mark = ~(1u << (page % 8));
+
+  if (!storage_program(data_offset(upload, page), stage, sizeof(stage)) ||
+      !storage_program(region_offset(upload) +
+                           offsetof(struct blob_header, pages) + page / 8,
+                       &mark, sizeof(mark))) {
+    return false;
+  }
+
+  memset(stage, 0xFF, sizeof(stage));
+  return true;
+}
+
+// Once all of the data has been received, check it and commit it.
+static bool finish_upload(void) {
+  const struct blob_header* hdr = header(upload);
+
+  if (region_crc(upload, hdr->size) != hdr->crc) {
+    upload_state = BLOB_UPLOAD_BAD_CRC;
+    return false;
+  }
+
+  uint32_t tag = header_tag(hdr);
+  if (!storage_program(region_offset(upload) +
+                           offsetof(struct blob_header, tag),
+                       &tag, sizeof(tag))) {
+    return false;
+  }
+
+  active = upload;
+  upload = NO_REGION;
+  upload_state = BLOB_UPLOAD_NONE;
+  received = 0;
+
+  return true;
+}
+
+/*
+ * Pick an upload back up from the last page that was programmed. If every page
+ * was programmed but the tag wasn't (the last write was interrupted), the
+ * upload is finished now.
+ */
+static bool resume_upload(void) {
+  size_t size = header(upload)->size;
+
+  memset(stage, 0xFF, sizeof(stage));
+  received = pages_done(upload) * FLASH_PAGE_SIZE;
+  if (received >= size) {
+    received = size;
+    return finish_upload();
+  }
+
+  return true;
+}
+
+void blob_init(void) {
+  active = NO_REGION;
+  upload = NO_REGION;
+  upload_state = BLOB_UPLOAD_NONE;
+  received = 0;
+  memset(stage, 0xFF, sizeof(stage));
+
+  for (int region = 0; region < 2; ++region) {
+    if (is_committed(region) &&
+        (active == NO_REGION ||
+         (int32_t)(header(region)->seq - header(active)->seq) > 0)) {
+      active = region;
+    }
+  }
+
+  // An unfinished upload is only resumable if it's newer than the stored blob.
+  for (int region = 0; region < 2; ++region) {
+    if (region == active || !is_started(region) || is_committed(region) ||
+        (active != NO_REGION &&
+         (int32_t)(header(region)->seq - header(active)->seq) <= 0)) {
+      continue;
+    }
+
+    upload = region;
+    upload_state = BLOB_UPLOAD_ACTIVE;
+    resume_upload();
+    break;
+  }
+}
+
+bool blob_info(size_t* size, uint32_t* crc) {
+  if (active == NO_REGION) return false;
+
+  *size = header(active)->size;
+  *crc = header(active)->crc;
+  return true;
+}
+
+const uint8_t* blob_read(size_t offset, size_t* len) {
+  if (active == NO_REGION || offset >= header(active)->size) return NULL;
+
+  size_t remaining = header(active)->size - offset;
+  if (*len > remaining) *len = remaining;
+
+  uint32_t pos = data_offset(active, 0) + offset;
+  size_t n = FLASH_SECTOR_SIZE - pos % FLASH_SECTOR_SIZE;
+  if (*len > n) *len = n;
+
+  return storage_ptr(pos);
+}
+
+bool blob_begin(size_t size, uint32_t crc) {
+  if (size > BLOB_MAX_SIZE) return false;
+
+  // Resume an unfinished upload of the same blob. One that failed its CRC
+  // check has to start over.
+  if (upload != NO_REGION && upload_state == BLOB_UPLOAD_ACTIVE &&
+      header(upload)->size == size && header(upload)->crc == crc) {
+    return resume_upload();
+  }
+
+  int region = (active == NO_REGION) ? 0 : 1 - active;
+  upload = NO_REGION;
+  upload_state = BLOB_UPLOAD_NONE;
+  received = 0;
+  memset(stage, 0xFF, sizeof(stage));
+
+  for (uint32_t i = 0; i < BLOB_SECTORS; ++i) {
+    uint32_t offset = region_offset(region) + i * FLASH_SECTOR_SIZE;
+    if (!storage_is_erased(offset, FLASH_SECTOR_SIZE) &&
+        !storage_erase(offset)) {
+      return false;
+    }
+  }
+
+  struct blob_header hdr;
+  memset(&hdr, 0xFF, sizeof(hdr));
+  hdr.magic = BLOB_MAGIC;
+  hdr.seq = (active != NO_REGION) ? header(active)->seq + 1 : 0;
+  hdr.size = size;
+  hdr.crc = crc;
+  hdr.check = header_check(&hdr);
+
+  if (!storage_program(region_offset(region), &hdr, sizeof(hdr))) return false;
+
+  upload = region;
+  upload_state = BLOB_UPLOAD_ACTIVE;
+
+  // An empty blob is complete as soon as it's started.
+  if (size == 0) return finish_upload();
+
+  return true;
+}
+
+bool blob_write(size_t offset, const void* data, size_t len) {
+  if (upload_state != BLOB_UPLOAD_ACTIVE || offset != received) return false;
+
+  size_t size = header(upload)->size;
+  if (len > size - received) return false;
+
+  const uint8_t* src = data;
+  while (len > 0) {
+    size_t pos = received % FLASH_PAGE_SIZE;
+    size_t n = sizeof(stage) - pos;
+    if (n > len) n = len;
+
+    memcpy(stage + pos, src, n);
+    src += n;
+    len -= n;
+    received += n;
+
+    // Program each page as soon as it's full, or once the last byte is in.
+    if (received % FLASH_PAGE_SIZE == 0 || received == size) {
+      if (!program_stage((received - 1) / FLASH_PAGE_SIZE)) {
+        // The page can be sent again from its start.
+        received -= (received - 1) % FLASH_PAGE_SIZE + 1;
+        memset(stage, 0xFF, sizeof(stage));
+        return false;
+      }
+    }
+  }
+
+  if (received == size) return finish_upload();
+
+  return true;
+}
+
+enum blob_upload_state blob_upload_status(size_t* received_out,
+                                          size_t* size) {
+  if (upload == NO_REGION) {
+    *received_out = 0;
+    *size = 0;
+  } else {
+    *received_out = received;
+    *size = header(upload)->size;
+  }
+
+  return upload_state;
+}
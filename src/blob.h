@@ -0,0 +1,116 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+#ifndef PICO_IDENT_BLOB_H
+#define PICO_IDENT_BLOB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kv.h"
+
+/*
+ * The blob is kept in flash right after the key-value store. There are two
+ * regions of BLOB_SECTORS sectors each. The stored blob is in one of them, and
+ * uploads go to the other, so the stored blob is only replaced once a new one
+ * has been completely uploaded and checked. The first page of each region is
+ * its header, and the blob follows it.
+ */
+#define BLOB_OFFSET (KV_OFFSET + KV_SECTORS * FLASH_SECTOR_SIZE)
+#define BLOB_SECTORS (8)
+
+// The largest blob that can be stored.
+#define BLOB_MAX_SIZE (BLOB_SECTORS * FLASH_SECTOR_SIZE - FLASH_PAGE_SIZE)
+
+/*
+ * State of the upload.
+ */
+enum blob_upload_state {
+  // No upload has been started since the last one finished.
+  BLOB_UPLOAD_NONE,
+  // An upload has been started, and not all of the data has been received.
+  BLOB_UPLOAD_ACTIVE,
+  // All of the data was received, but its CRC-32 didn't match.
+  BLOB_UPLOAD_BAD_CRC,
+};
+
+/**
+ * @brief Find the blob in flash, along with any unfinished upload. This must
+ * be called once at boot before any other blob function.
+ */
+void blob_init(void);
+
+/**
+ * @brief Get the size and CRC-32 of the stored blob.
+ *
+ * @param[out] size set to the size of the blob in bytes
+ * @param[out] crc set to the CRC-32 of the blob
+ *
+ * @return True if there's a stored blob.
+ */
+bool blob_info(size_t* size, uint32_t* crc);
+
+/**
+ * @brief Read part of the stored blob.
+ *
+ * The blob isn't necessarily in one piece in flash, so this returns as much of
+ * the requested data as it can in one piece. Call it again for the rest.
+ *
+ * @param[in] offset the offset into the blob to read from
+ * @param[in,out] len the number of bytes to read, set to the number of bytes
+ * that can be read from the returned pointer
+ *
+ * @return A pointer to the data in flash, or NULL if there's nothing to read
+ * at that offset.
+ */
+const uint8_t* blob_read(size_t offset, size_t* len);
+
+/**
+ * @brief Start uploading a new blob.
+ *
+ * If there's an unfinished upload with the same size and CRC-32, even from
+ * before a reset, it's resumed instead of starting over. Use
+ * blob_upload_status() to find out where to resume from.
+ *
+ * @param[in] size the size of the new blob in bytes
+ * @param[in] crc the CRC-32 of the new blob
+ *
+ * @return True if the upload was started or resumed.
+ */
+bool blob_begin(size_t size, uint32_t crc);
+
+/**
+ * @brief Write the next chunk of the blob being uploaded.
+ *
+ * Chunks must be written in order, starting from where the upload left off.
+ * Each page of the blob is programmed into flash as soon as it's complete.
+ * Once the last chunk is written, the CRC-32 of the new blob is checked, and if
+ * it matches, the new blob replaces the stored one.
+ *
+ * @param[in] offset the offset of the chunk in the blob
+ * @param[in] data the chunk
+ * @param[in] len the length of the chunk in bytes
+ *
+ * @return True if the chunk was written.
+ */
+bool blob_write(size_t offset, const void* data, size_t len);
+
+/**
+ * @brief Get the progress of the upload.
+ *
+ * @param[out] received set to the number of bytes received so far
+ * @param[out] size set to the size of the blob being uploaded
+ *
+ * @return The state of the upload.
+ */
+enum blob_upload_state blob_upload_status(size_t* received, size_t* size);
+
+#endif  // PICO_IDENT_BLOB_H
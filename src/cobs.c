@@ -0,0 +1,60 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+#include "cobs.h"
+
+size_t cobs_encode(const void* data, size_t len, uint8_t* out) {
+  const uint8_t* src = data;
+  // Each code byte gives the distance to the next zero (or to the next code
+  // byte, for a run of 254 non-zero bytes).
+  size_t code_pos = 0;
+  size_t pos = 1;
+  uint8_t code = 1;
+
+  for (size_t i = 0; i < len; ++i) {
+    if (src[i] != 0) {
+      out[pos++] = src[i];
+      ++code;
+    }
+
+    if (src[i] == 0 || code == 0xFF) {
+      out[code_pos] = code;
+      code_pos = pos++;
+      code = 1;
+    }
+  }
+
+  out[code_pos] = code;
+  return pos;
+}
+
+bool cobs_decode(const uint8_t* data, size_t len, uint8_t* out,
+                 size_t* out_len) {
+  size_t pos = 0;
+  size_t n = 0;
+
+  while (pos < len) {
+    uint8_t code = data[pos++];
+    if (code == 0 || (size_t)(code - 1) > len - pos) return false;
+
+    for (uint8_t i = 1; i < code; ++i) {
+      out[n++] = data[pos++];
+    }
+
+    // A code of 0xFF is a full run with no zero after it, and there's no zero
+    // after the last run either.
+    if (code != 0xFF && pos < len) {
+      out[n++] = 0;
+    }
+  }
+
+  *out_len = n;
+  return true;
+}
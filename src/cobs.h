@@ -0,0 +1,53 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+#ifndef PICO_IDENT_COBS_H
+#define PICO_IDENT_COBS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Consistent Overhead Byte Stuffing (COBS) removes every zero byte from a
+ * block of data, so that zero bytes can be used to mark where frames end.
+ */
+
+// The longest a block of len bytes can be once it's encoded.
+#define COBS_MAX_ENCODED(len) ((len) + (len) / 254 + 1)
+
+/**
+ * @brief Encode a block of data with COBS. The zero byte that ends the frame
+ * isn't included.
+ *
+ * @param[in] data the data
+ * @param[in] len the length of the data in bytes
+ * @param[out] out the buffer for the encoded data (at least
+ * COBS_MAX_ENCODED(len) bytes)
+ *
+ * @return The length of the encoded data in bytes.
+ */
+size_t cobs_encode(const void* data, size_t len, uint8_t* out);
+
+/**
+ * @brief Decode a block of COBS-encoded data, without the zero byte that ends
+ * the frame. The data can be decoded in place.
+ *
+ * @param[in] data the encoded data
+ * @param[in] len the length of the encoded data in bytes
+ * @param[out] out the buffer for the decoded data (at least len bytes)
+ * @param[out] out_len set to the length of the decoded data in bytes
+ *
+ * @return True if the data was valid.
+ */
+bool cobs_decode(const uint8_t* data, size_t len, uint8_t* out,
+                 size_t* out_len);
+
+#endif  // PICO_IDENT_COBS_H
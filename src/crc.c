@@ -0,0 +1,183 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+#include "crc.h"
+
+#include <stdbool.h>
+
+#include "pico/stdlib.h"
+
+// The CRC-32 polynomial, bit-reversed.
+#define CRC32_POLY (0xEDB88320u)
+
+// The CRC-16 polynomial, not reversed.
+#define CRC16_POLY (0x1021u)
+
+#if PICO_ON_DEVICE
+
+#include "hardware/dma.h"
+
+// Sniffer mode for CRC-32 with bit-reversed input data.
+#define SNIFF_MODE_CRC32_REV (0x1)
+
+/*
+ * Run data through the CRC-32 shift register starting from init, which must be
+ * either 0 or all ones. The final inversion is not applied.
+ */
+static uint32_t crc32_reg(uint32_t init, const void* data, size_t len) {
+  static int chan = -1;
+  static uint32_t dummy;
+
+  if (len == 0) return init;
+
+  if (chan < 0) {
+    chan = dma_claim_unused_channel(true);
+  }
+
+  // Transfer whole words when possible, since that's 4x fewer transfers.
+  bool words = (((uintptr_t)data | len) % sizeof(uint32_t)) == 0;
+
+  dma_channel_config cfg = dma_channel_get_default_config(chan);
+  channel_config_set_transfer_data_size(&cfg, words ? DMA_SIZE_32 : DMA_SIZE_8);
+  channel_config_set_read_increment(&cfg, true);
+  channel_config_set_write_increment(&cfg, false);
+  channel_config_set_sniff_enable(&cfg, true);
+
+  // Feeding the data in bit-reversed and then reversing the result gives the
+  // same register as the usual table-driven implementation.
+  dma_sniffer_enable(chan, SNIFF_MODE_CRC32_REV, true);
+  dma_sniffer_set_output_reverse_enabled(true);
+  dma_sniffer_set_output_invert_enabled(false);
+  dma_sniffer_set_data_accumulator(init);
+
+  dma_channel_configure(chan, &cfg, &dummy, data,
+                        words ? len / sizeof(uint32_t) : len, true);
+  dma_channel_wait_for_finish_blocking(chan);
+
+  return dma_sniffer_get_data_accumulator();
+}
+
+#else
+
+/*
+ * Run data through the CRC-32 shift register starting from init. The final
+ * inversion is not applied.
+ */
+static uint32_t crc32_reg(uint32_t init, const void* data, size_t len) {
+  static uint32_t table[256];
+  static bool table_ready = false;
+
+  if (!table_ready) {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; ++bit) {
+        crc = (crc >> 1) ^ ((crc & 1) ? CRC32_POLY : 0);
+      }
+      table[i] = crc;
+    }
+    table_ready = true;
+  }
+
+  const uint8_t* bytes = data;
+  uint32_t crc = init;
+
+  for (size_t i = 0; i < len; ++i) {
+    crc = (crc >> 8) ^ table[(crc ^ bytes[i]) & 0xFF];
+  }
+
+  return crc;
+}
+
+#endif
+
+/*
+ * Multiply two polynomials modulo the CRC-32 polynomial (all bit-reversed).
+ */
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+  uint32_t p = 0;
+
+  for (uint32_t m = 1u << 31; m != 0; m >>= 1) {
+    if (a & m) p ^= b;
+    b = (b & 1) ? (b >> 1) ^ CRC32_POLY : b >> 1;
+  }
+
+  return p;
+}
+
+/*
+ * Compute x^(8n) modulo the CRC-32 polynomial. Multiplying a CRC register by
+ * this is the same as running n zero bytes through it.
+ */
+static uint32_t zeros_factor(size_t n) {
+  // The factors only depend on where in a block a change happens, so there
+  // are usually only a handful of distinct ones. Keep the recent ones around.
+  static struct {
+    size_t n;
+    uint32_t factor;
+  } cache[16];
+  static size_t cache_next = 0;
+
+  for (size_t i = 0; i < cache_next && i < count_of(cache); ++i) {
+    if (cache[i].n == n) return cache[i].factor;
+  }
+
+  // Square-and-multiply, starting from x^8.
+  uint32_t factor = 1u << 31;
+  uint32_t sq = 1u << 23;
+  for (size_t k = n; k != 0; k >>= 1) {
+    if (k & 1) factor = multmodp(sq, factor);
+    sq = multmodp(sq, sq);
+  }
+
+  cache[cache_next % count_of(cache)].n = n;
+  cache[cache_next % count_of(cache)].factor = factor;
+  ++cache_next;
+
+  return factor;
+}
+
+uint32_t crc32(const void* data, size_t len) {
+  return ~crc32_reg(0xFFFFFFFFu, data, len);
+}
+
+uint32_t crc32_tag(const void* data, size_t len) {
+  return crc32(data, len) & 0x7FFFFFFFu;
+}
+
+uint32_t crc32_update(uint32_t crc, const void* delta, size_t len,
+                      size_t after) {
+  // CRCs of equal-length blocks are linear, so the CRC of the new block is the
+  // old CRC XORed with the raw CRC of the difference between the two. Leading
+  // zeros in the difference don't change the raw CRC, and trailing ones just
+  // multiply it by a constant.
+  return crc ^ multmodp(zeros_factor(after), crc32_reg(0, delta, len));
+}
+
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2) {
+  // Appending the second block is the same as running len2 zero bytes through
+  // the register after the first block, then adding in the second block's CRC.
+  return multmodp(zeros_factor(len2), crc1) ^ crc2;
+}
+
+uint16_t crc16(const void* data, size_t len) {
+  const uint8_t* p = data;
+  uint16_t crc = 0xFFFF;
+
+  for (size_t i = 0; i < len; ++i) {
+    crc ^= p[i] << 8;
+    for (int bit = 0; bit < 8; ++bit) {
+      bool carry = crc & 0x8000;
+      crc <<= 1;
+      if (carry) crc ^= CRC16_POLY;
+    }
+  }
+
+  return crc;
+}
@@ -0,0 +1,81 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+#ifndef PICO_IDENT_CRC_H
+#define PICO_IDENT_CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Compute the CRC-32 (IEEE 802.3, as used by zlib) of a block of data.
+ *
+ * On the Pico, this runs the data through a DMA channel with the DMA sniffer
+ * enabled, so the CPU does almost no work. Elsewhere, a table-driven software
+ * implementation is used. Both give the same result.
+ *
+ * @param[in] data the data
+ * @param[in] len the length of the data in bytes
+ *
+ * @return The CRC-32 of the data.
+ */
+uint32_t crc32(const void* data, size_t len);
+
+/**
+ * @brief Compute the integrity tag of a header in flash: the CRC-32 of its
+ * fields, with the top bit cleared so that a valid tag can never look like an
+ * unprogrammed one.
+ *
+ * @param[in] data the fields covered by the tag
+ * @param[in] len the length of the fields in bytes
+ *
+ * @return The tag.
+ */
+uint32_t crc32_tag(const void* data, size_t len);
+
+/**
+ * @brief Update the CRC-32 of a block of data after part of it has changed,
+ * without reading the rest of the block.
+ *
+ * @param[in] crc the CRC-32 of the block before the change
+ * @param[in] delta the old bytes of the changed part XORed with the new ones
+ * @param[in] len the length of the changed part in bytes
+ * @param[in] after the number of bytes in the block after the changed part
+ *
+ * @return The CRC-32 of the block after the change.
+ */
+uint32_t crc32_update(uint32_t crc, const void* delta, size_t len,
+                      size_t after);
+
+/**
+ * @brief Combine the CRC-32s of two blocks of data into the CRC-32 of both
+ * blocks one after the other.
+ *
+ * @param[in] crc1 the CRC-32 of the first block
+ * @param[in] crc2 the CRC-32 of the second block
+ * @param[in] len2 the length of the second block in bytes
+ *
+ * @return The CRC-32 of the first block followed by the second.
+ */
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+
+/**
+ * @brief Compute the CRC-16 (CCITT-FALSE: polynomial 0x1021, initial value
+ * 0xFFFF) of a block of data. This is meant for short messages, so it's
+ * computed a bit at a time in software.
+ *
+ * @param[in] data the data
+ * @param[in] len the length of the data in bytes
+ *
+ * @return The CRC-16 of the data.
+ */
+uint16_t crc16(const void* data, size_t len);
+
+#endif  // PICO_IDENT_CRC_H
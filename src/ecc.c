@@ -0,0 +1,101 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+#include "ecc.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+/*
+ * Each data bit is given a 6-bit code that isn't zero or a power of two: bit 0
+ * gets 3, bit 1 gets 5, and so on up to 38. Check bit j is the parity of every
+ * data bit whose code has bit j set, so these are the masks of those data bits.
+ * If a single data bit flips, the check bits that change spell out its code.
+ */
+static const uint32_t masks[6] = {
+    0x56AAAD5Bu, 0x9B33366Du, 0xE3C3C78Eu,
+    0x03FC07F0u, 0x03FFF800u, 0xFC000000u,
+};
+
+// Bit 6 of each check byte is the parity of the whole word, which tells a
+// single-bit error (odd) apart from a double-bit error (even).
+#define PARITY_BIT (1u << 6)
+#define CHECK_BITS (0x3Fu)
+
+static uint32_t parity(uint32_t x) {
+  x ^= x >> 16;
+  x ^= x >> 8;
+  x ^= x >> 4;
+  return (0x6996u >> (x & 0xFu)) & 1u;
+}
+
+static uint32_t hamming(uint32_t word) {
+  uint32_t check = 0;
+
+  for (int j = 0; j < 6; ++j) {
+    check |= parity(word & masks[j]) << j;
+  }
+
+  return check;
+}
+
+static uint8_t word_check(uint32_t word) {
+  uint32_t check = hamming(word);
+  return check | ((parity(word) ^ parity(check)) ? PARITY_BIT : 0);
+}
+
+// Load a word of data, padding a partial word with zeros.
+static uint32_t load_word(const uint8_t* data, size_t len) {
+  uint32_t word = 0;
+  memcpy(&word, data, (len < sizeof(word)) ? len : sizeof(word));
+  return word;
+}
+
+void ecc_encode(const void* data, size_t len, uint8_t* check) {
+  const uint8_t* bytes = data;
+
+  for (size_t i = 0; i < ECC_CHECK_SIZE(len); ++i) {
+    check[i] = word_check(load_word(bytes + i * 4, len - i * 4));
+  }
+}
+
+enum ecc_result ecc_correct(void* data, size_t len, const uint8_t* check) {
+  uint8_t* bytes = data;
+  enum ecc_result result = ECC_OK;
+
+  for (size_t i = 0; i < ECC_CHECK_SIZE(len); ++i) {
+    size_t n = (len - i * 4 < 4) ? len - i * 4 : 4;
+    uint32_t word = load_word(bytes + i * 4, n);
+
+    uint32_t syndrome = (check[i] & CHECK_BITS) ^ hamming(word);
+    bool odd = parity(word) ^ parity(check[i] & (CHECK_BITS | PARITY_BIT));
+    if (syndrome == 0 && !odd) continue;
+
+    // An even number of flipped bits can't be corrected.
+    if (!odd) return ECC_FAILED;
+
+    // If the syndrome is zero or a power of two, the flipped bit is in the
+    // check byte and the data is fine. Otherwise, find the data bit.
+    if ((syndrome & (syndrome - 1)) != 0) {
+      int bit = 0;
+      while (bit < 32 && hamming(1u << bit) != syndrome) ++bit;
+
+      // The padding of a partial word is always zero, so it can't be wrong.
+      if (bit >= 32 || (size_t)bit >= n * 8) return ECC_FAILED;
+
+      word ^= 1u << bit;
+      memcpy(bytes + i * 4, &word, n);
+    }
+
+    result = ECC_CORRECTED;
+  }
+
+  return result;
+}
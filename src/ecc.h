@@ -0,0 +1,56 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+#ifndef PICO_IDENT_ECC_H
+#define PICO_IDENT_ECC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Number of check bytes needed for len bytes of data. There's one for each
+ * 32-bit word, with a partial word at the end padded with zeros.
+ */
+#define ECC_CHECK_SIZE(len) (((len) + 3) / 4)
+
+enum ecc_result {
+  // The data had no errors.
+  ECC_OK,
+  // The data had errors, and they were all corrected.
+  ECC_CORRECTED,
+  // The data had errors that couldn't be corrected.
+  ECC_FAILED,
+};
+
+/**
+ * @brief Compute the check bytes for a block of data.
+ *
+ * Each 32-bit word of the data is protected by a Hamming SECDED code, which can
+ * correct any single-bit error in the word and detect any double-bit error.
+ *
+ * @param[in] data the data
+ * @param[in] len the length of the data in bytes
+ * @param[out] check buffer for the check bytes (ECC_CHECK_SIZE(len) bytes)
+ */
+void ecc_encode(const void* data, size_t len, uint8_t* check);
+
+/**
+ * @brief Check a block of data against its check bytes, correcting any errors
+ * that can be corrected in place.
+ *
+ * @param[in,out] data the data
+ * @param[in] len the length of the data in bytes
+ * @param[in] check the check bytes computed by ecc_encode()
+ *
+ * @return Whether the data had any errors, and whether they were corrected.
+ */
+enum ecc_result ecc_correct(void* data, size_t len, const uint8_t* check);
+
+#endif  // PICO_IDENT_ECC_H
@@ -0,0 +1,283 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+#include "journal.h"
+
+#include <string.h>
+
+#include "ecc.h"
+#include "pico/stdlib.h"
+#include "storage.h"
+
+/*
+ * Magic number marking the start of a record. The low byte is not a printable
+ * character, so the start of a headerless device info structure from an older
+ * firmware can never be mistaken for a record.
+ */
+#define JOURNAL_MAGIC (0x4A8E15B8u)
+
+#define PAGES_PER_SECTOR (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+
+/*
+ * Header at the start of every record. Records always start on a page
+ * boundary and take up a whole number of pages.
+ */
+struct journal_header {
+  uint32_t magic;
+  // Sequence number, incremented for each record written.
+  uint32_t seq;
+  // Length of the data following this header.
+  uint32_t len;
+  // Check bytes for the fields above (see ecc.h), so that a bit error in the
+  // header can't make the record look invalid or out of order.
+  uint8_t check[ECC_CHECK_SIZE(12)];
+  // Programmed to 0 after the rest of the record, so a record that was
+  // interrupted while being written is never committed. Any value with more
+  // bits clear than set counts, so a single bit error can't change this.
+  uint8_t commit;
+};
+
+_Static_assert(sizeof(struct journal_header) + JOURNAL_MAX_LEN ==
+                   FLASH_SECTOR_SIZE,
+               "JOURNAL_MAX_LEN doesn't match the header size");
+
+// Number of pages taken up by a record with len bytes of data.
+#define RECORD_PAGES(len)                                          \
+  ((sizeof(struct journal_header) + (len) + FLASH_PAGE_SIZE - 1) / \
+   FLASH_PAGE_SIZE)
+
+// Value of latest when the journal is empty.
+#define NO_RECORD (0xFFFFFFFFu)
+
+// What was found where a record header should be.
+enum header_state {
+  // Nothing, or a record that was never committed.
+  HEADER_NONE,
+  // A valid header.
+  HEADER_OK,
+  // A valid header that had errors, which were corrected.
+  HEADER_CORRECTED,
+  // A committed record whose header has errors that couldn't be corrected.
+  HEADER_DAMAGED,
+};
+
+// Count the bits set in a byte.
+static unsigned bits_set(uint8_t b) {
+  unsigned n = 0;
+
+  for (; b != 0; b &= b - 1) {
+    ++n;
+  }
+
+  return n;
+}
+
+// Get the offset of a page in a journal.
+static uint32_t page_offset(const struct journal* j, uint32_t sector,
+                            uint32_t page) {
+  return j->offset + sector * FLASH_SECTOR_SIZE + page * FLASH_PAGE_SIZE;
+}
+
+/*
+ * Program a record starting at a page-aligned offset. The record is programmed
+ * one page at a time so that only a single page buffer is needed.
+ */
+static bool program_record(uint32_t offset, const struct journal_header* hdr,
+                           const void* data, size_t len) {
+  static uint8_t buf[FLASH_PAGE_SIZE];
+  const uint8_t* src = data;
+  size_t remaining = len;
+
+  for (uint32_t i = 0; i < RECORD_PAGES(len); ++i) {
+    size_t pos = 0;
+
+    // Any bytes left as FF won't be changed by programming.
+    memset(buf, 0xFF, sizeof(buf));
+    if (i == 0) {
+      memcpy(buf, hdr, sizeof(*hdr));
+      pos = sizeof(*hdr);
+    }
+
+    size_t n = sizeof(buf) - pos;
+    if (n > remaining) n = remaining;
+    memcpy(buf + pos, src, n);
+    src += n;
+    remaining -= n;
+
+    if (!storage_program(offset + i * FLASH_PAGE_SIZE, buf, FLASH_PAGE_SIZE)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/*
+ * Read the header of the record starting at a page in a journal into hdr,
+ * correcting any errors in it. Only the header is read.
+ */
+static enum header_state read_header(const struct journal* j, uint32_t sector,
+                                     uint32_t page,
+                                     struct journal_header* hdr) {
+  memcpy(hdr, storage_ptr(page_offset(j, sector, page)), sizeof(*hdr));
+
+  if (bits_set(hdr->commit) > 4) return HEADER_NONE;
+
+  enum ecc_result result =
+      ecc_correct(hdr, offsetof(struct journal_header, check), hdr->check);
+  if (result == ECC_FAILED || hdr->magic != JOURNAL_MAGIC) {
+    return HEADER_DAMAGED;
+  }
+
+  if (hdr->len > JOURNAL_MAX_LEN ||
+      RECORD_PAGES(hdr->len) > PAGES_PER_SECTOR - page) {
+    return HEADER_DAMAGED;
+  }
+
+  return (result == ECC_CORRECTED) ? HEADER_CORRECTED : HEADER_OK;
+}
+
+void journal_init(struct journal* j) {
+  struct journal_header newest = {0};
+  struct journal_header hdr;
+  enum header_state state;
+  enum header_state latest_state = HEADER_NONE;
+  bool found = false;
+  bool damaged = false;
+
+  j->health = ECC_OK;
+
+  // Sectors are filled one at a time in order, so the newest record is in the
+  // sector whose first record is the newest. Only the first header of each
+  // sector needs to be read to find it.
+  for (uint32_t sector = 0; sector < j->sectors; ++sector) {
+    state = read_header(j, sector, 0, &hdr);
+    if (state == HEADER_DAMAGED) damaged = true;
+
+    // Compare sequence numbers in a way that survives wrapping.
+    if ((state == HEADER_OK || state == HEADER_CORRECTED) &&
+        (!found || (int32_t)(hdr.seq - newest.seq) > 0)) {
+      newest = hdr;
+      latest_state = state;
+      found = true;
+      j->cur_sector = sector;
+    }
+  }
+
+  // With an empty journal, start writing at the first sector. A damaged
+  // header could have been the only record, though.
+  if (!found) {
+    j->latest = NO_RECORD;
+    j->cur_sector = 0;
+    j->next_page = 0;
+    if (damaged) j->health = ECC_FAILED;
+    return;
+  }
+
+  // The newest record is the last valid one in that sector. If the last write
+  // was interrupted, it was never committed, so this stops at the record
+  // before it.
+  j->latest = page_offset(j, j->cur_sector, 0);
+  j->latest_seq = newest.seq;
+  j->latest_len = newest.len;
+  j->next_page = RECORD_PAGES(newest.len);
+  while (j->next_page < PAGES_PER_SECTOR) {
+    state = read_header(j, j->cur_sector, j->next_page, &hdr);
+    if (state == HEADER_NONE) break;
+
+    // A damaged header after the newest readable record could belong to a
+    // newer one, which has been skipped.
+    if (state == HEADER_DAMAGED) {
+      j->health = ECC_FAILED;
+      return;
+    }
+
+    latest_state = state;
+    j->latest = page_offset(j, j->cur_sector, j->next_page);
+    j->latest_seq = hdr.seq;
+    j->latest_len = hdr.len;
+    j->next_page += RECORD_PAGES(hdr.len);
+  }
+
+  // The next sector would be written after this one, so if its first header is
+  // damaged, that could be the newest record too. Move on to it with the next
+  // record so it gets erased and replaced.
+  uint32_t next_sector = (j->cur_sector + 1) % j->sectors;
+  if (read_header(j, next_sector, 0, &hdr) == HEADER_DAMAGED) {
+    j->health = ECC_FAILED;
+    j->next_page = PAGES_PER_SECTOR;
+    return;
+  }
+
+  if (latest_state == HEADER_CORRECTED) j->health = ECC_CORRECTED;
+}
+
+const void* journal_latest(const struct journal* j, size_t* len) {
+  if (j->latest == NO_RECORD) return NULL;
+
+  if (len != NULL) {
+    *len = j->latest_len;
+  }
+
+  return (const struct journal_header*)storage_ptr(j->latest) + 1;
+}
+
+enum ecc_result journal_health(const struct journal* j) {
+  return j->health;
+}
+
+bool journal_append(struct journal* j, const void* data, size_t len) {
+  if (len > JOURNAL_MAX_LEN) return false;
+  uint32_t pages = RECORD_PAGES(len);
+
+  // If the record doesn't fit in the rest of the current sector (or the pages
+  // there aren't clean for some reason), move on to the next sector and erase
+  // it if needed.
+  if (j->next_page + pages > PAGES_PER_SECTOR ||
+      !storage_is_erased(page_offset(j, j->cur_sector, j->next_page),
+                         pages * FLASH_PAGE_SIZE)) {
+    j->cur_sector = (j->cur_sector + 1) % j->sectors;
+    j->next_page = 0;
+
+    uint32_t sector = page_offset(j, j->cur_sector, 0);
+    if (!storage_is_erased(sector, FLASH_SECTOR_SIZE) &&
+        !storage_erase(sector)) {
+      return false;
+    }
+  }
+
+  struct journal_header hdr = {
+      .magic = JOURNAL_MAGIC,
+      .seq = (j->latest != NO_RECORD) ? j->latest_seq + 1 : 0,
+      .len = len,
+      .commit = 0xFF,
+  };
+  ecc_encode(&hdr, offsetof(struct journal_header, check), hdr.check);
+
+  // Program the record with the commit byte left unprogrammed, then program it
+  // by itself. Until it's written, the previous record is still the newest
+  // one. If anything fails, the pages used so far are skipped over.
+  uint32_t offset = page_offset(j, j->cur_sector, j->next_page);
+  j->next_page += pages;
+  if (!program_record(offset, &hdr, data, len)) return false;
+
+  hdr.commit = 0;
+  if (!storage_program(offset + offsetof(struct journal_header, commit),
+                       &hdr.commit, sizeof(hdr.commit))) {
+    return false;
+  }
+
+  j->latest = offset;
+  j->latest_seq = hdr.seq;
+  j->latest_len = len;
+  j->health = ECC_OK;
+
+  return true;
+}
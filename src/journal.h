@@ -0,0 +1,107 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+#ifndef PICO_IDENT_JOURNAL_H
+#define PICO_IDENT_JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ecc.h"
+#include "storage.h"
+
+/*
+ * Number of sectors in the device info journal, at the start of the storage
+ * partition. A journal must have at least 2 sectors so that the sector holding
+ * the newest record is never the one being erased.
+ */
+#define JOURNAL_SECTORS (4)
+
+/*
+ * The longest record that can be stored in a journal. Each record has a
+ * 16-byte header and must fit in a single sector.
+ */
+#define JOURNAL_MAX_LEN (FLASH_SECTOR_SIZE - 16)
+
+/*
+ * A journal in the storage partition. Define each one with JOURNAL() and leave
+ * the rest of the members to the journal functions.
+ */
+struct journal {
+  // Offset of the first sector of the journal, and the number of sectors.
+  uint32_t offset;
+  uint32_t sectors;
+  // Offset, sequence number and length of the newest record.
+  uint32_t latest;
+  uint32_t latest_seq;
+  uint32_t latest_len;
+  // Sector and page within that sector where the next record will go.
+  uint32_t cur_sector;
+  uint32_t next_page;
+  // Errors found in the record headers when the journal was scanned.
+  enum ecc_result health;
+};
+
+#define JOURNAL(offset, sectors) \
+  {(offset), (sectors), 0xFFFFFFFFu, 0, 0, 0, 0, ECC_OK}
+
+/**
+ * @brief Scan a journal for the newest record. This must be called once at
+ * boot before any other function is used on the journal.
+ *
+ * @param[in,out] j the journal
+ */
+void journal_init(struct journal* j);
+
+/**
+ * @brief Get the newest record in a journal.
+ *
+ * @param[in] j the journal
+ * @param[out] len if not NULL, set to the length of the record in bytes
+ *
+ * @return A pointer to the record's data in flash, or NULL if the journal is
+ * empty.
+ */
+const void* journal_latest(const struct journal* j, size_t* len);
+
+/**
+ * @brief Find out whether errors were found in the record headers when a
+ * journal was scanned.
+ *
+ * Single-bit errors in a header are corrected as it's read. If the newest
+ * record's header had one, the record should be written again. If a header has
+ * errors that can't be corrected, the newest record might have been skipped,
+ * and journal_latest() might return an older one. Either way, this goes back to
+ * ECC_OK once a new record is appended.
+ *
+ * @param[in] j the journal
+ *
+ * @return ECC_OK if there were no errors, ECC_CORRECTED if the newest record's
+ * header had errors that were corrected, or ECC_FAILED if a header that could
+ * be the newest couldn't be read.
+ */
+enum ecc_result journal_health(const struct journal* j);
+
+/**
+ * @brief Append a record to a journal.
+ *
+ * The record is programmed into the next free pages of the current sector. The
+ * next sector in the journal is only erased once the current one is full.
+ *
+ * @param[in,out] j the journal
+ * @param[in] data the record data
+ * @param[in] len the length of the record in bytes
+ *
+ * @return True if the record was written, false if it was too large.
+ */
+bool journal_append(struct journal* j, const void* data, size_t len);
+
+#endif  // PICO_IDENT_JOURNAL_H
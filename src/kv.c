@@ -0,0 +1,470 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+#include "kv.h"
+
+#include <string.h>
+
+#include "crc.h"
+#include "pico/stdlib.h"
+#include "storage.h"
+
+// Magic number marking the start of a bank.
+#define KV_MAGIC (0x4B56C0DEu)
+
+#define BANK_SECTORS (1 + KV_DATA_SECTORS)
+#define DATA_SIZE (KV_DATA_SECTORS * FLASH_SECTOR_SIZE)
+
+_Static_assert(JOURNAL_SECTORS + KV_SECTORS <= STORAGE_SECTORS,
+               "the journal and key-value store don't fit in STORAGE_SIZE");
+
+// Special values for the hash in an index slot. Real hashes never take these
+// values.
+#define SLOT_EMPTY (0xFFFFFFFFu)
+#define SLOT_DELETED (0x00000000u)
+
+// No bank is in use.
+#define NO_BANK (0xFFFFFFFFu)
+
+/*
+ * Header at the start of each bank's index sector.
+ */
+struct kv_header {
+  uint32_t magic;
+  // Incremented every time the store is compacted into the other bank.
+  uint32_t generation;
+  uint32_t reserved;
+  // Integrity tag, programmed after everything else in the bank.
+  uint32_t tag;
+};
+
+/*
+ * A slot in the hash index. Slots are write-once: a slot is filled in when a
+ * key is added, and deleting the key just clears the hash to SLOT_DELETED.
+ */
+struct kv_slot {
+  uint32_t hash;
+  // Offset of the entry in the bank's data area.
+  uint32_t loc;
+};
+
+#define NUM_SLOTS \
+  ((FLASH_SECTOR_SIZE - sizeof(struct kv_header)) / sizeof(struct kv_slot))
+
+// Most keys the store can hold, which keeps probe sequences short.
+#define MAX_KEYS (NUM_SLOTS * 3 / 4)
+
+// Compact once this many slots (live or deleted) are used. The slots past
+// MAX_KEYS leave room for updates, so a full store isn't compacted every time
+// one of its keys is changed.
+#define MAX_USED_SLOTS (NUM_SLOTS * 7 / 8)
+
+/*
+ * In a bank's data area, each entry is the key length, the value length, the
+ * key, and the value, all packed together with no padding. Sectors may be
+ * replaced by spares elsewhere in flash, so entries never cross from one sector
+ * to the next. If an entry doesn't fit in the rest of a sector, it goes at the
+ * start of the next one instead, and the rest of the sector is left erased.
+ */
+#define ENTRY_SIZE(klen, vlen) (2 + (klen) + (vlen))
+
+// Bank in use, or NO_BANK if the store has never been written.
+static uint32_t bank = NO_BANK;
+static uint32_t generation = 0;
+
+// Number of slots in the index that aren't empty, and how many of those hold
+// the current value of a key.
+static size_t used_slots = 0;
+static size_t live_keys = 0;
+
+// Set when nothing has been deleted or replaced since the bank was compacted,
+// so compacting it again wouldn't free anything.
+static bool compacted = false;
+
+// End of the entries in the data area.
+static size_t data_end = 0;
+
+static uint32_t bank_offset(uint32_t b) {
+  return KV_OFFSET + b * BANK_SECTORS * FLASH_SECTOR_SIZE;
+}
+
+static const struct kv_header* bank_header(uint32_t b) {
+  return storage_ptr(bank_offset(b));
+}
+
+static const struct kv_slot* bank_slots(uint32_t b) {
+  return (const struct kv_slot*)(bank_header(b) + 1);
+}
+
+// Get the offset of a location in a bank's data area.
+static uint32_t data_offset(uint32_t b, uint32_t loc) {
+  return bank_offset(b) + FLASH_SECTOR_SIZE + loc;
+}
+
+// Get a pointer to the entry at a location in a bank's data area.
+static const uint8_t* entry_at(uint32_t b, uint32_t loc) {
+  return storage_ptr(data_offset(b, loc));
+}
+
+/*
+ * Check that an entry at a location in a bank's data area lies entirely within
+ * it. A damaged slot can point anywhere, so this is checked before any entry
+ * a slot points to is read.
+ */
+static bool entry_in_bounds(uint32_t b, uint32_t loc) {
+  if (loc > DATA_SIZE - ENTRY_SIZE(0, 0)) return false;
+
+  const uint8_t* entry = entry_at(b, loc);
+  size_t len = ENTRY_SIZE(entry[0], entry[1]);
+  return len <= DATA_SIZE - loc;
+}
+
+// Get the location where an entry of len bytes can go, at or after pos.
+static size_t entry_pos(size_t pos, size_t len) {
+  if (pos % FLASH_SECTOR_SIZE + len > FLASH_SECTOR_SIZE) {
+    pos += FLASH_SECTOR_SIZE - pos % FLASH_SECTOR_SIZE;
+  }
+
+  return pos;
+}
+
+// Get the flash offset of a slot in a bank's index.
+static uint32_t slot_offset(uint32_t b, size_t i) {
+  return bank_offset(b) + sizeof(struct kv_header) + i * sizeof(struct kv_slot);
+}
+
+static uint32_t header_tag(const struct kv_header* hdr) {
+  return crc32_tag(hdr, offsetof(struct kv_header, tag));
+}
+
+// FNV-1a hash of a key, adjusted to never be one of the special slot values.
+static uint32_t hash_key(const char* key, size_t len) {
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < len; ++i) {
+    hash = (hash ^ (uint8_t)key[i]) * 16777619u;
+  }
+
+  if (hash == SLOT_EMPTY || hash == SLOT_DELETED) hash = 1;
+
+  return hash;
+}
+
+// Check whether the entry at loc in the current bank has the given key.
+static bool entry_matches(uint32_t loc, const char* key, size_t len) {
+  if (!entry_in_bounds(bank, loc)) return false;
+
+  const uint8_t* entry = entry_at(bank, loc);
+  return entry[0] == len && memcmp(entry + 2, key, len) == 0;
+}
+
+/*
+ * Find the index slot holding a key in the current bank, or -1 if it isn't
+ * there. Only the slots in the key's probe sequence are read.
+ */
+static int find_slot(const char* key, size_t len) {
+  if (bank == NO_BANK) return -1;
+
+  const struct kv_slot* slots = bank_slots(bank);
+  uint32_t hash = hash_key(key, len);
+  int found = -1;
+
+  for (size_t n = 0, i = hash % NUM_SLOTS; n < NUM_SLOTS;
+       ++n, i = (i + 1) % NUM_SLOTS) {
+    if (slots[i].hash == SLOT_EMPTY) break;
+
+    // If a write was interrupted after adding a key's new slot but before
+    // deleting its old one, the key will be in two slots. New slots always go
+    // after old ones in the probe sequence, so the last match is the newest.
+    if (slots[i].hash == hash && entry_matches(slots[i].loc, key, len)) {
+      found = i;
+    }
+  }
+
+  return found;
+}
+
+// Find the first empty slot in a key's probe sequence in an index.
+static int empty_slot(const struct kv_slot* slots, uint32_t hash) {
+  for (size_t n = 0, i = hash % NUM_SLOTS; n < NUM_SLOTS;
+       ++n, i = (i + 1) % NUM_SLOTS) {
+    if (slots[i].hash == SLOT_EMPTY) return i;
+  }
+
+  return -1;
+}
+
+/*
+ * Copy every live key into the other bank, dropping deleted keys and old
+ * values, and switch to it. The old bank is left intact until the next
+ * compaction, so an interrupted or failed compaction loses nothing.
+ */
+static bool compact(void) {
+  static uint8_t index[FLASH_SECTOR_SIZE];
+  static uint8_t page[FLASH_PAGE_SIZE];
+
+  uint32_t to = (bank == NO_BANK) ? 0 : !bank;
+  uint32_t offset = bank_offset(to);
+
+  for (uint32_t i = 0; i < BANK_SECTORS; ++i) {
+    uint32_t sector = offset + i * FLASH_SECTOR_SIZE;
+    if (!storage_is_erased(sector, FLASH_SECTOR_SIZE) &&
+        !storage_erase(sector)) {
+      return false;
+    }
+  }
+
+  // Build the new index in RAM and stream the entries out a page at a time.
+  memset(index, 0xFF, sizeof(index));
+  memset(page, 0xFF, sizeof(page));
+
+  struct kv_header* hdr = (struct kv_header*)index;
+  struct kv_slot* slots = (struct kv_slot*)(hdr + 1);
+  size_t pos = 0;
+  size_t used = 0;
+
+  if (bank != NO_BANK) {
+    const struct kv_slot* old_slots = bank_slots(bank);
+
+    for (size_t i = 0; i < NUM_SLOTS; ++i) {
+      uint32_t hash = old_slots[i].hash;
+      if (hash == SLOT_EMPTY || hash == SLOT_DELETED) continue;
+      if (!entry_in_bounds(bank, old_slots[i].loc)) continue;
+
+      const uint8_t* entry = entry_at(bank, old_slots[i].loc);
+      size_t len = ENTRY_SIZE(entry[0], entry[1]);
+
+      // Skip stale duplicates left by an interrupted write.
+      if ((int)i != find_slot((const char*)entry + 2, entry[0])) continue;
+
+      // If the entry has to move to the next sector, write out what's been
+      // buffered so far first.
+      size_t next = entry_pos(pos, len);
+      if (next != pos && pos % FLASH_PAGE_SIZE != 0) {
+        if (!storage_program(data_offset(to, pos - pos % FLASH_PAGE_SIZE),
+                             page, FLASH_PAGE_SIZE)) {
+          return false;
+        }
+        memset(page, 0xFF, sizeof(page));
+      }
+      pos = next;
+
+      int slot = empty_slot(slots, hash);
+      slots[slot].hash = hash;
+      slots[slot].loc = pos;
+      ++used;
+
+      for (size_t j = 0; j < len; ++j, ++pos) {
+        page[pos % FLASH_PAGE_SIZE] = entry[j];
+        if ((pos + 1) % FLASH_PAGE_SIZE == 0) {
+          if (!storage_program(data_offset(to, pos + 1 - FLASH_PAGE_SIZE),
+                               page, FLASH_PAGE_SIZE)) {
+            return false;
+          }
+          memset(page, 0xFF, sizeof(page));
+        }
+      }
+    }
+
+    if (pos % FLASH_PAGE_SIZE != 0 &&
+        !storage_program(data_offset(to, pos - pos % FLASH_PAGE_SIZE), page,
+                         FLASH_PAGE_SIZE)) {
+      return false;
+    }
+  }
+
+  // Program the index with the tag left unprogrammed, then the tag. Until the
+  // tag is written, the old bank is still the one in use.
+  hdr->magic = KV_MAGIC;
+  hdr->generation = generation + 1;
+  if (!storage_program(offset, index, sizeof(index))) return false;
+
+  uint32_t tag = header_tag(hdr);
+  if (!storage_program(offset + offsetof(struct kv_header, tag), &tag,
+                       sizeof(tag))) {
+    return false;
+  }
+
+  bank = to;
+  generation = hdr->generation;
+  used_slots = used;
+  live_keys = used;
+  data_end = pos;
+  compacted = true;
+
+  return true;
+}
+
+void kv_init(void) {
+  bank = NO_BANK;
+  compacted = false;
+
+  for (uint32_t b = 0; b < 2; ++b) {
+    const struct kv_header* hdr = bank_header(b);
+    if (hdr->magic != KV_MAGIC || hdr->tag != header_tag(hdr)) continue;
+
+    if (bank == NO_BANK || (int32_t)(hdr->generation - generation) > 0) {
+      bank = b;
+      generation = hdr->generation;
+    }
+  }
+
+  if (bank == NO_BANK) return;
+
+  const struct kv_slot* slots = bank_slots(bank);
+  used_slots = 0;
+  for (size_t i = 0; i < NUM_SLOTS; ++i) {
+    if (slots[i].hash != SLOT_EMPTY) ++used_slots;
+  }
+
+  size_t pos = 0;
+  size_t len;
+  live_keys = 0;
+  while (kv_next(&pos, &len) != NULL) {
+    ++live_keys;
+  }
+
+  // Entries are packed one after another, so the end of the last one is the
+  // first place where a key length is still erased. That's also where an entry
+  // that didn't fit in the rest of a sector would have gone, so keep going if
+  // the next sector has entries.
+  data_end = 0;
+  while (data_end < DATA_SIZE - 1) {
+    const uint8_t* entry = entry_at(bank, data_end);
+    if (entry[0] == 0xFF) {
+      size_t next = entry_pos(data_end, FLASH_SECTOR_SIZE);
+      if (next >= DATA_SIZE || *entry_at(bank, next) == 0xFF) break;
+      data_end = next;
+      continue;
+    }
+
+    data_end += ENTRY_SIZE(entry[0], entry[1]);
+  }
+}
+
+const char* kv_get(const char* key, size_t* len) {
+  int slot = find_slot(key, strlen(key));
+  if (slot < 0) return NULL;
+
+  const uint8_t* entry = entry_at(bank, bank_slots(bank)[slot].loc);
+  *len = entry[1];
+
+  return (const char*)entry + 2 + entry[0];
+}
+
+bool kv_set(const char* key, const char* value) {
+  size_t klen = strlen(key);
+  size_t vlen = strlen(value);
+
+  if (klen == 0 || klen > KV_KEY_MAX || vlen > KV_VALUE_MAX ||
+      strpbrk(key, "=?,") != NULL) {
+    return false;
+  }
+
+  // Don't bother writing anything if the value hasn't changed.
+  size_t cur_len;
+  const char* cur = kv_get(key, &cur_len);
+  if (cur != NULL && cur_len == vlen && memcmp(cur, value, vlen) == 0) {
+    return true;
+  }
+
+  // Replacing a key's value doesn't add a key, since its old slot is deleted.
+  if (cur == NULL && live_keys >= MAX_KEYS) return false;
+
+  size_t len = ENTRY_SIZE(klen, vlen);
+  size_t pos = entry_pos(data_end, len);
+  bool full = used_slots >= MAX_USED_SLOTS || pos + len > DATA_SIZE;
+  if (bank == NO_BANK || full ||
+      !storage_is_erased(data_offset(bank, pos), len)) {
+    // If the store is full of live keys and values, compacting it won't help,
+    // and erasing the other bank would only wear it out.
+    if (full && compacted) return false;
+    if (!compact()) return false;
+
+    pos = entry_pos(data_end, len);
+    if (used_slots >= MAX_USED_SLOTS || pos + len > DATA_SIZE) {
+      return false;
+    }
+  }
+
+  // Write the entry first, then the slot that points to it, then delete the
+  // old slot. If this is interrupted, either the old or the new value is kept.
+  static uint8_t entry[ENTRY_SIZE(KV_KEY_MAX, KV_VALUE_MAX)];
+  entry[0] = klen;
+  entry[1] = vlen;
+  memcpy(entry + 2, key, klen);
+  memcpy(entry + 2 + klen, value, vlen);
+
+  // The data area is used up to here even if programming fails, since the
+  // bytes there may no longer be erased.
+  data_end = pos + len;
+  if (!storage_program(data_offset(bank, pos), entry, len)) {
+    compacted = false;
+    return false;
+  }
+
+  int old = find_slot(key, klen);
+  struct kv_slot slot = {
+      .hash = hash_key(key, klen),
+      .loc = pos,
+  };
+  int i = empty_slot(bank_slots(bank), slot.hash);
+  ++used_slots;
+  if (!storage_program(slot_offset(bank, i), &slot, sizeof(slot))) {
+    compacted = false;
+    return false;
+  }
+
+  if (old >= 0) {
+    uint32_t deleted = SLOT_DELETED;
+    compacted = false;
+    return storage_program(slot_offset(bank, old), &deleted, sizeof(deleted));
+  }
+
+  ++live_keys;
+  return true;
+}
+
+bool kv_del(const char* key) {
+  int slot = find_slot(key, strlen(key));
+  if (slot < 0) return false;
+
+  uint32_t deleted = SLOT_DELETED;
+  if (!storage_program(slot_offset(bank, slot), &deleted, sizeof(deleted))) {
+    return false;
+  }
+
+  --live_keys;
+  compacted = false;
+  return true;
+}
+
+const char* kv_next(size_t* pos, size_t* len) {
+  if (bank == NO_BANK) return NULL;
+
+  const struct kv_slot* slots = bank_slots(bank);
+
+  while (*pos < NUM_SLOTS) {
+    size_t i = (*pos)++;
+    if (slots[i].hash == SLOT_EMPTY || slots[i].hash == SLOT_DELETED) continue;
+    if (!entry_in_bounds(bank, slots[i].loc)) continue;
+
+    const uint8_t* entry = entry_at(bank, slots[i].loc);
+    const char* key = (const char*)entry + 2;
+
+    // Skip stale duplicates left by an interrupted write.
+    if ((int)i != find_slot(key, entry[0])) continue;
+
+    *len = entry[0];
+    return key;
+  }
+
+  return NULL;
+}
@@ -0,0 +1,84 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+#ifndef PICO_IDENT_KV_H
+#define PICO_IDENT_KV_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "journal.h"
+
+/*
+ * The key-value store is kept in flash right after the journal. It's made up
+ * of two banks, only one of which is in use at a time. Each bank has a sector
+ * for its hash index followed by KV_DATA_SECTORS sectors for the keys and
+ * values.
+ */
+#define KV_OFFSET (JOURNAL_SECTORS * FLASH_SECTOR_SIZE)
+#define KV_DATA_SECTORS (3)
+#define KV_SECTORS (2 * (1 + KV_DATA_SECTORS))
+
+// Limits on the lengths of keys and values.
+#define KV_KEY_MAX (32)
+#define KV_VALUE_MAX (128)
+
+/**
+ * @brief Find the key-value store in flash. This must be called once at boot
+ * before any other key-value store function.
+ */
+void kv_init(void);
+
+/**
+ * @brief Look up the value of a key.
+ *
+ * @param[in] key the key (null-terminated)
+ * @param[out] len set to the length of the value in bytes
+ *
+ * @return A pointer to the value in flash (not null-terminated), or NULL if
+ * the key isn't in the store.
+ */
+const char* kv_get(const char* key, size_t* len);
+
+/**
+ * @brief Set the value of a key, adding it if it isn't in the store already.
+ *
+ * Keys must be 1 to KV_KEY_MAX characters long and can't contain '=', '?', or
+ * ','. Values can be up to KV_VALUE_MAX characters long.
+ *
+ * @param[in] key the key (null-terminated)
+ * @param[in] value the value (null-terminated)
+ *
+ * @return True if the value was stored, false if the key or value was invalid
+ * or the store is full.
+ */
+bool kv_set(const char* key, const char* value);
+
+/**
+ * @brief Remove a key from the store.
+ *
+ * @param[in] key the key (null-terminated)
+ *
+ * @return True if the key was removed, false if it wasn't in the store.
+ */
+bool kv_del(const char* key);
+
+/**
+ * @brief Iterate over the keys in the store.
+ *
+ * @param[in,out] pos the iteration position, which should start at 0
+ * @param[out] len set to the length of the key in bytes
+ *
+ * @return A pointer to the next key in flash (not null-terminated), or NULL if
+ * there are no more keys.
+ */
+const char* kv_next(size_t* pos, size_t* len);
+
+#endif  // PICO_IDENT_KV_H
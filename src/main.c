@@ -9,226 +9,1856 @@
  */
 
 #include <ctype.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
-#include "hardware/flash.h"
+#include "blob.h"
+#include "cobs.h"
+#include "crc.h"
+#include "ecc.h"
 #include "hardware/gpio.h"
-#include "hardware/sync.h"
+#include "journal.h"
+#include "kv.h"
 #include "pico/binary_info.h"
 #include "pico/stdlib.h"
 #include "pico/unique_id.h"
+#include "slots.h"
+
+#if PICO_IDENT_SCRUB
+#include "scrub.h"
+#endif
 
 /*
  * GPIO pins for write lock.
  */
-#define WRLOCK_OUT (14)
-#define WRLOCK_IN (15)
+#define WRLOCK_OUT (14)
+#define WRLOCK_IN (15)
+
+/*
+ * The device info fields. For each field, this gives its name in commands, its
+ * member in struct device_info, its size (including the null terminator), and
+ * whether it can be written over serial (RW) or not (RO). Everything else about
+ * the fields is generated from this list.
+ *
+ * A field's position in this list is also its tag in flash (starting at 1), so
+ * never reorder these, only add new fields to the end.
+ */
+#define DEVINFO_FIELDS(X)           \
+  X("MFG", mfg, 64, RW)             \
+  X("NAME", name, 64, RW)           \
+  X("VER", ver, 64, RW)             \
+  X("DATE", date, 64, RW)           \
+  X("PART", part, 64, RW)           \
+  X("MFGSERIAL", mfgserial, 64, RW) \
+  X("USER1", user1, 64, RW)         \
+  X("USER2", user2, 64, RW)         \
+  X("USER3", user3, 64, RW)         \
+  X("USER4", user4, 64, RW)
+
+// Helpers for expanding DEVINFO_FIELDS.
+#define FIELD_MEMBER(name, member, size, access) char member[size];
+#define FIELD_ENTRY(name, member, size, access)                          \
+  {name, sizeof(name) - 1, offsetof(struct device_info, member), (size), \
+   FIELD_##access},
+#define FIELD_RECORD_SIZE(name, member, size, access) +2 + (size)-1
+#define FIELD_CHECK_SIZE(name, member, size, access) \
+  _Static_assert((size) >= 2 && (size) <= 256,       \
+                 "size of " name " must be between 2 and 256");
+
+/*
+ * This is the structure containing the info to store.
+ *
+ * Each of the strings in this structure is assumed to be null-terminated.
+ */
+struct device_info {
+  DEVINFO_FIELDS(FIELD_MEMBER)
+
+  // This checksum field is the CRC-32 of all of the previous bytes in this
+  // structure.
+  uint32_t checksum;
+};
+
+// Size of the largest field.
+#define FIELD_MAX_SIZE sizeof(union { DEVINFO_FIELDS(FIELD_MEMBER) })
+
+// Lengths are stored in a single byte in flash.
+DEVINFO_FIELDS(FIELD_CHECK_SIZE)
+
+enum field_access {
+  FIELD_RO,
+  FIELD_RW,
+};
+
+/*
+ * Table of the device info fields, in the same order as DEVINFO_FIELDS.
+ */
+static const struct field {
+  const char* name;
+  size_t name_len;
+  size_t offset;
+  size_t size;
+  enum field_access access;
+} fields[] = {DEVINFO_FIELDS(FIELD_ENTRY)};
+
+/*
+ * Header at the start of each device info record in flash. If the magic number
+ * and version match, the record was written by this firmware from validated
+ * data, so it can be used at boot without checking it any further. Data stored
+ * in any other format is converted to the current one at boot.
+ */
+struct record_header {
+  uint16_t magic;
+  uint16_t version;
+  uint32_t checksum;
+};
+
+#define RECORD_MAGIC (0x4944u)
+
+/*
+ * Version of the record format. Version 1 is the raw struct device_info with an
+ * 8-bit checksum, as stored by v1.2.0 and earlier. Bump this whenever the
+ * format changes, and teach read_devinfo() to read the old one.
+ */
+#define RECORD_VERSION (2)
+
+/*
+ * Device info is stored in flash as a record header followed by a tag, length,
+ * and value for each non-empty field. The values are not null-terminated.
+ *
+ * The last entry in the record has the tag ECC_TAG, and holds the check bytes
+ * for everything before it, so single-bit errors can be corrected. Firmware
+ * that doesn't know about it skips it like any other unknown tag.
+ */
+#define ECC_TAG (0xFF)
+
+// Largest record, without and with the ECC entry.
+#define RECORD_DATA_MAX_SIZE \
+  (sizeof(struct record_header) DEVINFO_FIELDS(FIELD_RECORD_SIZE))
+#define RECORD_MAX_SIZE \
+  (RECORD_DATA_MAX_SIZE + 2 + ECC_CHECK_SIZE(RECORD_DATA_MAX_SIZE))
+
+_Static_assert(count_of(fields) < ECC_TAG, "too many fields");
+_Static_assert(ECC_CHECK_SIZE(RECORD_DATA_MAX_SIZE) <= 255,
+               "ECC entry is too long");
+_Static_assert(RECORD_MAX_SIZE <= JOURNAL_MAX_LEN,
+               "device info record doesn't fit in a journal sector");
+
+/*
+ * Data stored by older firmware (before the journal) is the first ten fields of
+ * struct device_info followed by an 8-bit checksum, 512K from the start of
+ * flash. That's outside the storage partition, so it's only there to be
+ * migrated, and only if this program doesn't extend over it.
+ */
+#define LEGACY_DEVINFO_OFFSET (512 * 1024)
+#define LEGACY_DEVINFO ((const uint8_t*)(XIP_BASE + LEGACY_DEVINFO_OFFSET))
+#define LEGACY_DEVINFO_SIZE (10 * 64)
+
+// End of this program in flash, defined by the linker.
+extern const uint8_t __flash_binary_end[];
+
+_Static_assert(LEGACY_DEVINFO_SIZE <= offsetof(struct device_info, checksum),
+               "the original fields must stay at the start of device_info");
+
+// Journal holding the device info records, at the start of the partition.
+static struct journal devinfo_journal = JOURNAL(0, JOURNAL_SECTORS);
+
+_Static_assert(JOURNAL_SECTORS >= 2, "journal needs at least two sectors");
+
+// Device info in RAM. Queries are answered from here, and writes are applied
+// here right away and committed to flash later by flush_devinfo().
+struct device_info devinfo;
+
+// Set when devinfo has changes that haven't been committed to flash yet.
+bool devinfo_dirty = false;
+
+// Version of the format the device info in flash is stored in, or 0 if nothing
+// valid has been stored.
+unsigned stored_version = 0;
+
+// Set when the device info in flash had errors that couldn't be corrected, so
+// the copy in RAM can't be trusted to repair it. Until the device info is
+// cleared, writes that only change some of the fields are refused, since they
+// would store whatever is left of the rest with a valid checksum.
+bool devinfo_damaged = false;
+
+// Set when the slots have changes that haven't been committed to flash yet.
+bool slots_dirty = false;
+
+// Time of the last change to devinfo or the slots, and of the first one that
+// hasn't been committed to flash yet.
+absolute_time_t last_change;
+absolute_time_t first_change;
+
+// How long after the last change pending changes are committed to flash, as
+// long as no command is partway through arriving. Writes that arrive closer
+// together than this are committed together.
+#define COMMIT_DELAY_US (20 * 1000)
+
+// Longest that pending changes are held back, even if a command is partway
+// through arriving (or a stray byte was never followed by a carriage return)
+// or more writes keep coming.
+#define COMMIT_MAX_DELAY_US (100 * 1000)
+
+// Largest chunk of blob data accepted by a single BLOB.WRITE. Encoded in hex,
+// this still leaves room for the offset in the lexer's argument buffer.
+#define BLOB_CHUNK_MAX (240)
+
+// Cached response to CHECK?, or NULL if the flash has been written since it was
+// last computed.
+const char* check_response = NULL;
+
+// Board ID (this is set only once and stored here).
+char board_id[PICO_UNIQUE_BOARD_ID_SIZE_BYTES * 2 + 1];
+
+// Time since boot when the device was ready to handle commands, and when it
+// handled the first one, in microseconds.
+uint64_t ready_us = 0;
+uint64_t first_msg_us = 0;
+
+/**
+ * @brief Check whether writing is locked by the WRLOCK_IN pin.
+ *
+ * @return True if writing is locked.
+ */
+bool write_locked(void) { return gpio_get(WRLOCK_IN); }
+
+/**
+ * @brief Encode a device info structure to be stored in flash.
+ *
+ * @param[in] info the structure to encode
+ * @param[out] buf buffer to hold the encoded data (at least RECORD_MAX_SIZE)
+ *
+ * @return The length of the encoded data in bytes.
+ */
+size_t encode_devinfo(const struct device_info* info, uint8_t* buf) {
+  struct record_header hdr = {
+      .magic = RECORD_MAGIC,
+      .version = RECORD_VERSION,
+      .checksum = info->checksum,
+  };
+  size_t pos = 0;
+
+  memcpy(buf, &hdr, sizeof(hdr));
+  pos += sizeof(hdr);
+
+  // Empty fields are left out entirely.
+  for (size_t i = 0; i < count_of(fields); ++i) {
+    const char* value = (const char*)info + fields[i].offset;
+    size_t len = strnlen(value, fields[i].size - 1);
+
+    if (len > 0) {
+      buf[pos++] = i + 1;
+      buf[pos++] = len;
+      memcpy(buf + pos, value, len);
+      pos += len;
+    }
+  }
+
+  size_t data_len = pos;
+  buf[pos++] = ECC_TAG;
+  buf[pos++] = ECC_CHECK_SIZE(data_len);
+  ecc_encode(buf, data_len, buf + pos);
+  pos += ECC_CHECK_SIZE(data_len);
+
+  return pos;
+}
+
+/**
+ * @brief Decode the fields of a device info structure stored in flash.
+ *
+ * Tags for unknown fields are skipped, so newer firmware can add fields without
+ * confusing older firmware.
+ *
+ * @param[in] data the encoded fields, following the header
+ * @param[in] len the length of the encoded fields in bytes
+ * @param[out] info the structure to decode into (must already be zeroed)
+ *
+ * @return True if the data was decoded, false if it was malformed.
+ */
+bool decode_fields(const uint8_t* data, size_t len, struct device_info* info) {
+  size_t pos = 0;
+  while (pos < len) {
+    if (len - pos < 2) return false;
+
+    uint8_t tag = data[pos++];
+    uint8_t vlen = data[pos++];
+    if (vlen > len - pos) return false;
+
+    if (tag >= 1 && tag <= count_of(fields) && vlen < fields[tag - 1].size) {
+      memcpy((char*)info + fields[tag - 1].offset, data + pos, vlen);
+    }
+
+    pos += vlen;
+  }
+
+  return true;
+}
+
+/**
+ * @brief Get the length of the data covered by the ECC entry at the end of a
+ * record.
+ *
+ * @param[in] len the length of the record in bytes
+ *
+ * @return The length of the data before the ECC entry, or 0 if a record of
+ * this length can't end with one.
+ */
+size_t record_data_len(size_t len) {
+  if (len < 2) return 0;
+
+  // The check bytes take up a fifth of the rest of the record, rounded up.
+  for (size_t n = (len - 2) / 5; n <= (len - 2) / 5 + 1 && n <= len - 2; ++n) {
+    if (ECC_CHECK_SIZE(len - 2 - n) == n) return len - 2 - n;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Read the device info stored in flash, in whichever format it was
+ * stored in.
+ *
+ * Only data read from a record in the current format has been validated and has
+ * a usable checksum. Anything else needs to be validated and stored again.
+ * Single-bit errors in a record with an ECC entry (or in the journal's record
+ * headers) are corrected as it's read. If the newest record can't be read at
+ * all, or might have been skipped, ecc is set to ECC_FAILED. So is it if data
+ * stored by older firmware doesn't match its 8-bit checksum.
+ *
+ * @param[out] info the structure to read into
+ * @param[out] ecc if not NULL, set to whether errors were found and corrected
+ *
+ * @return The version of the format the device info was stored in, or 0 if
+ * nothing valid has been stored or the newest record can't be read.
+ */
+unsigned read_devinfo(struct device_info* info, enum ecc_result* ecc) {
+  // The scrubber reads records on core1, so each core has its own buffer.
+  static uint8_t bufs[NUM_CORES][RECORD_DATA_MAX_SIZE];
+  uint8_t* buf = bufs[get_core_num()];
+  size_t len;
+  const uint8_t* record = journal_latest(&devinfo_journal, &len);
+  struct record_header hdr;
+
+  memset(info, 0, sizeof(*info));
+  if (ecc != NULL) *ecc = journal_health(&devinfo_journal);
+
+  // Version 1 data is only there if the journal has never been written. If it
+  // only has damaged records, it has been.
+  if (record == NULL) {
+    if (journal_health(&devinfo_journal) == ECC_FAILED) return 0;
+
+    size_t erased = 0;
+    while (erased < LEGACY_DEVINFO_SIZE && LEGACY_DEVINFO[erased] == 0xFF) {
+      ++erased;
+    }
+    if (__flash_binary_end > LEGACY_DEVINFO ||
+        erased == LEGACY_DEVINFO_SIZE) {
+      return 0;
+    }
+
+    // Older firmware checked its data with an 8-bit sum of every byte, stored
+    // right after the fields. If that doesn't match, the data is damaged, or
+    // isn't device info at all, so it mustn't be migrated as if it were valid.
+    uint8_t sum = 0;
+    for (size_t i = 0; i < LEGACY_DEVINFO_SIZE; ++i) {
+      sum += LEGACY_DEVINFO[i];
+    }
+    if (sum != LEGACY_DEVINFO[LEGACY_DEVINFO_SIZE] && ecc != NULL) {
+      *ecc = ECC_FAILED;
+    }
+
+    memcpy(info, LEGACY_DEVINFO, LEGACY_DEVINFO_SIZE);
+    return 1;
+  }
+
+  // Errors are corrected in a copy of the record before anything else is read
+  // from it, since they could be anywhere, even in the header. Newer versions
+  // are assumed to keep the same header and encoding, with any fields this
+  // firmware doesn't know about skipped.
+  size_t data_len = record_data_len(len);
+  if (data_len >= sizeof(hdr) && data_len <= sizeof(bufs[0])) {
+    memcpy(buf, record, data_len);
+    enum ecc_result result = ecc_correct(buf, data_len, record + data_len + 2);
+
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (result != ECC_FAILED && hdr.magic == RECORD_MAGIC &&
+        hdr.version >= RECORD_VERSION &&
+        decode_fields(buf + sizeof(hdr), data_len - sizeof(hdr), info)) {
+      info->checksum = hdr.checksum;
+      if (ecc != NULL && result > *ecc) *ecc = result;
+      return hdr.version;
+    }
+  }
+
+  // The newest record is there but can't be read, most likely because of
+  // errors that couldn't be corrected. Report it that way rather than as
+  // nothing stored, so it isn't replaced with an empty record.
+  memset(info, 0, sizeof(*info));
+  if (ecc != NULL) *ecc = ECC_FAILED;
+  return 0;
+}
+
+/**
+ * @brief Commit a device info structure to flash.
+ *
+ * This function compares the device info with what's already in flash and does
+ * as little as it can to store it. If nothing has changed, nothing is written.
+ * Otherwise, the device info is appended to the journal as a new record, which
+ * only erases a sector once it's full. A committed record is never programmed
+ * over, so a power cut can't leave a valid record with torn contents. Note that
+ * if the WRLOCK_IN pin is asserted, this function is a no-op.
+ *
+ * @param[in] info a pointer to a device info struct to store
+ *
+ * @return True if the device info is now stored in flash.
+ */
+bool store_devinfo(const struct device_info* info) {
+  static uint8_t buf[RECORD_MAX_SIZE];
+
+  if (write_locked() || info == NULL) return false;
+
+  size_t len = encode_devinfo(info, buf);
+
+  // Our provisioning scripts re-send the same values a lot.
+  size_t cur_len;
+  const uint8_t* cur = journal_latest(&devinfo_journal, &cur_len);
+  if (cur != NULL && journal_health(&devinfo_journal) == ECC_OK &&
+      cur_len == len && memcmp(cur, buf, len) == 0) {
+    return true;
+  }
+
+  check_response = NULL;
+
+  if (!journal_append(&devinfo_journal, buf, len)) return false;
+
+  stored_version = RECORD_VERSION;
+  devinfo_damaged = false;
+  return true;
+}
+
+/**
+ * @brief Compute the checksum (CRC-32) of a device info structure.
+ *
+ * @param[in] info the structure to use
+ *
+ * @return The CRC-32 of the structure.
+ */
+uint32_t compute_checksum(const struct device_info* info) {
+  if (info != NULL) {
+    return crc32(info, offsetof(struct device_info, checksum));
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Note the time of a change that needs to be committed to flash.
+ */
+void note_change(void) {
+  last_change = get_absolute_time();
+  if (!devinfo_dirty && !slots_dirty) first_change = last_change;
+}
+
+/**
+ * @brief Mark devinfo as changed so that it gets committed to flash
+ * COMMIT_DELAY_US after the last change. Its checksum must already be up to
+ * date.
+ */
+void update_devinfo(void) {
+  note_change();
+  devinfo_dirty = true;
+}
+
+/**
+ * @brief Mark the slots as changed so that they get committed to flash along
+ * with devinfo.
+ */
+void update_slots(void) {
+  note_change();
+  slots_dirty = true;
+}
+
+/**
+ * @brief Set one of the fields in devinfo and update its checksum.
+ *
+ * Rather than recomputing the checksum over the whole structure, this derives
+ * the new checksum from the old one and the bytes of the field that changed.
+ *
+ * @param[out] field the field in devinfo to set
+ * @param[in] value the new value (null-terminated)
+ * @param[in] len the size of the field
+ */
+void set_field(char* field, const char* value, size_t len) {
+  static char delta[FIELD_MAX_SIZE];
+
+  // The CRC update only needs to know what changed.
+  strncpy(delta, value, len);
+  for (size_t i = 0; i < len; ++i) {
+    delta[i] ^= field[i];
+  }
+  strncpy(field, value, len);
+
+  size_t after = offsetof(struct device_info, checksum) -
+                 (size_t)(field - (char*)&devinfo) - len;
+  devinfo.checksum = crc32_update(devinfo.checksum, delta, len, after);
+}
+
+/**
+ * @brief Validate the device info in RAM and clear any invalid data.
+ *
+ * On startup with a new pico, it's entirely possible for the flash to be in its
+ * erased state (filled with FFs). This, of course, does not equate to
+ * a zero-length string. This function checks the device info to make sure that
+ * it doesn't contain any FFs. If any field does, it will be zeroed out. This
+ * case should only arise on a fresh flash.
+ *
+ * @return True if any fields were cleared.
+ */
+bool validate_devinfo(void) {
+  bool cleared = false;
+
+  // Check the whole structure a word at a time first. A word contains an FF
+  // byte if inverting it gives a word with a zero byte.
+  const uint32_t* words = (const uint32_t*)&devinfo;
+  size_t w = 0;
+  for (; w < offsetof(struct device_info, checksum) / 4; ++w) {
+    if (((~words[w] - 0x01010101u) & words[w] & 0x80808080u) != 0) break;
+  }
+  if (w == offsetof(struct device_info, checksum) / 4) return false;
+
+  // We can be smart about this: any set field is guaranteed not to contain any
+  // FF bytes, as strncpy will have zero-filled it. Any field containing an
+  // invalid byte is therefore invalid.
+  for (size_t i = 0; i < count_of(fields); ++i) {
+    char* field = (char*)&devinfo + fields[i].offset;
+
+    if (memchr(field, 0xFF, fields[i].size) != NULL) {
+      memset(field, '\0', fields[i].size);
+      cleared = true;
+    }
+  }
+
+  return cleared;
+}
+
+/**
+ * @brief Load the device info from flash into RAM, making sure it's valid.
+ *
+ * A record in the current format is used as-is, and if it had any errors that
+ * were corrected, it needs to be stored again. If the stored data is damaged
+ * beyond repair, it's left alone, without a new checksum, so that CHECK?
+ * reports it and nothing is stored over it until it's rewritten in full. Data
+ * in an older format is validated and its checksum recomputed (older firmware
+ * used an 8-bit checksum), and it needs to be stored again to migrate it to
+ * the current format. Everything is converted in RAM first, so the migration
+ * only takes a single commit, and the old data stays intact until it's done.
+ *
+ * Data in a newer format is used as well as this firmware can, but it's never
+ * stored again automatically, since that would lose anything this firmware
+ * doesn't understand.
+ *
+ * @return True if the device info needs to be stored again.
+ */
+bool load_devinfo(void) {
+  enum ecc_result ecc;
+
+  stored_version = read_devinfo(&devinfo, &ecc);
+  devinfo_damaged = (ecc == ECC_FAILED);
+  if (devinfo_damaged) return false;
+  if (stored_version == RECORD_VERSION) return ecc == ECC_CORRECTED;
+
+  validate_devinfo();
+  devinfo.checksum = compute_checksum(&devinfo);
+  return stored_version < RECORD_VERSION;
+}
+
+/**
+ * @brief Commit any pending changes to devinfo to flash.
+ *
+ * @return False if there were changes and they couldn't be stored.
+ */
+bool flush_devinfo(void) {
+  if (!devinfo_dirty) return true;
+
+  // If the write lock was asserted after the changes were made, nothing was
+  // stored, so don't keep reporting values that aren't in flash.
+  bool stored = store_devinfo(&devinfo);
+  if (!stored) {
+    load_devinfo();
+  }
+  devinfo_dirty = false;
+  return stored;
+}
+
+/**
+ * @brief Commit any pending changes to the slots to flash.
+ */
+void flush_slots(void) {
+  if (!slots_dirty) return;
+
+  // As with devinfo, go back to what's in flash if the changes weren't stored.
+  if (write_locked() || !slots_store()) {
+    slots_init();
+  }
+  slots_dirty = false;
+}
+
+#if PICO_IDENT_SCRUB
+/**
+ * @brief Check the device info stored in flash against the copy in RAM. This
+ * is run on core1 by the scrubber, and only while core0 is idle.
+ *
+ * @return What the check found.
+ */
+enum scrub_finding scrub_devinfo(void) {
+  static struct device_info stored;
+  enum ecc_result ecc;
+
+  unsigned version = read_devinfo(&stored, &ecc);
+  if (ecc == ECC_FAILED) return SCRUB_UNCORRECTABLE;
+
+  // Data in any other format isn't something this firmware can check.
+  if (version != RECORD_VERSION) return SCRUB_OK;
+
+  if (memcmp(&stored, &devinfo, sizeof(stored)) != 0) return SCRUB_MISMATCH;
+
+  return (ecc == ECC_CORRECTED) ? SCRUB_CORRECTED : SCRUB_OK;
+}
+
+/**
+ * @brief Repair the device info after the scrubber found a problem with it.
+ *
+ * The copy in RAM is only stored over flash if its checksum shows it's still
+ * intact and it didn't come from data that was already damaged. If the copy in
+ * RAM is what's corrupted, it's reloaded from flash instead.
+ *
+ * @return True if a repair was made or queued.
+ */
+bool repair_devinfo(void) {
+  // Whatever the scrubber found, the cached CHECK? response no longer matches
+  // what's in flash.
+  check_response = NULL;
+
+  if (devinfo_damaged) return false;
+
+  if (compute_checksum(&devinfo) != devinfo.checksum) {
+    if (load_devinfo()) update_devinfo();
+    return true;
+  }
+
+  if (write_locked()) return false;
+
+  update_devinfo();
+  return true;
+}
+#endif
+
+/**
+ * @brief Decode a string of hex digits.
+ *
+ * @param[in] hex the hex digits (null-terminated)
+ * @param[out] out the buffer to decode into
+ * @param[in] max the size of the buffer
+ *
+ * @return The number of bytes decoded, or -1 if the string isn't an even
+ * number of hex digits or doesn't fit in the buffer.
+ */
+int decode_hex(const char* hex, uint8_t* out, size_t max) {
+  size_t len = strlen(hex);
+  if (len % 2 != 0 || len / 2 > max) return -1;
+
+  for (size_t i = 0; i < len; ++i) {
+    char c = hex[i];
+    int v;
+    if (c >= '0' && c <= '9') {
+      v = c - '0';
+    } else if (c >= 'A' && c <= 'F') {
+      v = c - 'A' + 10;
+    } else if (c >= 'a' && c <= 'f') {
+      v = c - 'a' + 10;
+    } else {
+      return -1;
+    }
+
+    if (i % 2 == 0) {
+      out[i / 2] = v << 4;
+    } else {
+      out[i / 2] |= v;
+    }
+  }
+
+  return len / 2;
+}
+
+/*
+ * Responses are collected here and sent once the command is done, so that each
+ * one goes out in a single write. In text mode, a response that doesn't fit is
+ * sent in pieces. In binary mode, it has to fit in one frame, so anything that
+ * doesn't fit is dropped and the command fails.
+ */
+#define REPLY_MAX (1024)
+
+struct reply_buffer {
+  char buf[REPLY_MAX];
+  size_t len;
+  // Set if part of the response was dropped.
+  bool overflow;
+} out;
+
+// Set while in binary mode.
+bool binary_mode = false;
+
+/**
+ * @brief Send the response collected so far in text mode.
+ */
+void send_reply(void) {
+  fwrite(out.buf, 1, out.len, stdout);
+  fflush(stdout);
+  out.len = 0;
+  out.overflow = false;
+}
+
+/**
+ * @brief Add to the response to the current command, like printf().
+ *
+ * @param[in] fmt the format string
+ */
+void reply(const char* fmt, ...) {
+  va_list args;
+
+  while (true) {
+    size_t room = sizeof(out.buf) - out.len;
+    va_start(args, fmt);
+    int n = vsnprintf(out.buf + out.len, room, fmt, args);
+    va_end(args);
+    if (n < 0) return;
+
+    if ((size_t)n < room) {
+      out.len += n;
+      return;
+    }
+
+    // Make room by sending what's there so far, if that's allowed.
+    if (binary_mode || out.len == 0) {
+      out.overflow = true;
+      return;
+    }
+    send_reply();
+  }
+}
+
+/**
+ * @brief Add a string to the response to the current command as it is, without
+ * going through printf(). Most queries just return a stored value, so this is
+ * their fast path.
+ *
+ * @param[in] str the string
+ * @param[in] len the length of the string in bytes
+ */
+void reply_str(const char* str, size_t len) {
+  while (true) {
+    size_t room = sizeof(out.buf) - out.len;
+    size_t n = (len < room) ? len : room;
+    memcpy(out.buf + out.len, str, n);
+    out.len += n;
+    if (n == len) return;
+
+    // Make room by sending what's there so far, if that's allowed.
+    if (binary_mode) {
+      out.overflow = true;
+      return;
+    }
+    send_reply();
+    str += n;
+    len -= n;
+  }
+}
+
+/**
+ * @brief Add a null-terminated value and a line ending to the response to the
+ * current command.
+ *
+ * @param[in] value the value
+ */
+void reply_line(const char* value) {
+  reply_str(value, strlen(value));
+  reply_str("\n", 1);
+}
+
+// Device info staged between BEGIN and COMMIT.
+struct device_info wrinfo;
+
+// Set between BEGIN and COMMIT/ABORT. While set, writes are only staged in
+// wrinfo and nothing is applied until COMMIT.
+bool in_transaction = false;
+
+// Set when CLEAR has been staged since BEGIN, so that COMMIT replaces all of
+// the device info.
+bool wrinfo_cleared = false;
+
+/**
+ * @brief Check whether a write can change only some of the fields. That's
+ * refused while the device info in flash is damaged, unless it's part of a
+ * transaction that started by clearing everything.
+ *
+ * @return True if the write can go ahead.
+ */
+bool partial_write_allowed(void) {
+  return !devinfo_damaged || (in_transaction && wrinfo_cleared);
+}
+
+/*
+ * Command handlers. Each one is passed whatever follows the command's name in
+ * the message, which it may modify, and returns whether it succeeded. Text
+ * commands don't report this, but it's the status of a binary mode response.
+ */
+enum cmd_result {
+  CMD_OK,
+  // The message was malformed, or the command couldn't be carried out.
+  CMD_FAILED,
+  // The command would have written something, but writing is locked.
+  CMD_LOCKED,
+};
+
+/**
+ * @brief Set or query one of the fields. Queries are answered straight from
+ * the copy in RAM.
+ *
+ * @param[in,out] arg the rest of the message after the field name
+ * @param[in] index the index of the field in fields
+ */
+enum cmd_result handle_field(char* arg, size_t index) {
+  const struct field* f = &fields[index];
+
+  if (*arg == '=' && f->access == FIELD_RW) {
+    if (!partial_write_allowed()) return CMD_FAILED;
+
+    ++arg;
+    arg[strnlen(arg, f->size - 1)] = '\0';
+    if (in_transaction) {
+      strncpy((char*)&wrinfo + f->offset, arg, f->size);
+    } else if (!write_locked()) {
+      set_field((char*)&devinfo + f->offset, arg, f->size);
+      update_devinfo();
+    } else {
+      return CMD_LOCKED;
+    }
+  } else if (*arg == '?') {
+    reply_line((const char*)&devinfo + f->offset);
+  } else {
+    return CMD_FAILED;
+  }
+
+  return CMD_OK;
+}
+
+enum cmd_result handle_serial(char* arg) {
+  if (*arg != '?') return CMD_FAILED;
+
+  reply_line(board_id);
+  return CMD_OK;
+}
+
+// Report how long it took to start up, in microseconds since boot.
+enum cmd_result handle_boot(char* arg) {
+  if (*arg != '?') return CMD_FAILED;
+
+  reply("READY:%llu,FIRST:%llu\n", (unsigned long long)ready_us,
+        (unsigned long long)first_msg_us);
+
+  return CMD_OK;
+}
+
+// Report the version of the format the device info is stored in, followed by
+// the version this firmware stores it in.
+enum cmd_result handle_format(char* arg) {
+  if (*arg != '?') return CMD_FAILED;
+
+  reply("%u,%u\n", stored_version, (unsigned)RECORD_VERSION);
+
+  return CMD_OK;
+}
+
+#if PICO_IDENT_SCRUB
+// Report what the scrubber has found.
+enum cmd_result handle_scrub(char* arg) {
+  if (*arg != '?') return CMD_FAILED;
+
+  struct scrub_stats stats;
+  scrub_get_stats(&stats);
+  reply("PASSES:%lu,ERRORS:%lu,REPAIRS:%lu\n", (unsigned long)stats.passes,
+        (unsigned long)stats.errors, (unsigned long)stats.repairs);
+
+  return CMD_OK;
+}
+
+// List the scrubber's findings as TIME:FINDING, with the time in milliseconds
+// since boot.
+enum cmd_result handle_scrub_log(char* arg) {
+  static const char* const names[] = {
+      [SCRUB_OK] = "OK",
+      [SCRUB_CORRECTED] = "CORRECTED",
+      [SCRUB_UNCORRECTABLE] = "UNCORRECTABLE",
+      [SCRUB_MISMATCH] = "MISMATCH",
+  };
+
+  if (*arg != '?') return CMD_FAILED;
+
+  struct scrub_log_entry log[SCRUB_LOG_SIZE];
+  size_t n = scrub_get_log(log);
+  for (size_t i = 0; i < n; ++i) {
+    reply("%s%lu:%s", (i > 0) ? "," : "", (unsigned long)log[i].time_ms,
+          names[log[i].finding]);
+  }
+  reply("\n");
+
+  return CMD_OK;
+}
+#endif
+
+// Report the health of the flash.
+enum cmd_result handle_health(char* arg) {
+  if (*arg != '?') return CMD_FAILED;
+
+  struct storage_health health;
+  storage_get_health(&health);
+  reply("RETRIES:%lu,FAILURES:%lu,RETIRED:%lu,SPARES:%lu\n",
+        (unsigned long)health.retries, (unsigned long)health.failures,
+        (unsigned long)health.retired, (unsigned long)health.spares);
+
+  return CMD_OK;
+}
+
+// Report each field's name, maximum length, and access.
+enum cmd_result handle_schema(char* arg) {
+  if (*arg != '?') return CMD_FAILED;
+
+  for (size_t i = 0; i < count_of(fields); ++i) {
+    reply("%s:%u:%s,", fields[i].name, (unsigned)(fields[i].size - 1),
+          (fields[i].access == FIELD_RW) ? "RW" : "RO");
+  }
+  reply("SERIAL:%u:RO\n", (unsigned)(sizeof(board_id) - 1));
+
+  return CMD_OK;
+}
+
+// Clear every field. This is the only way to replace device info that's damaged
+// in flash.
+enum cmd_result handle_clear(char* arg) {
+  if (*arg != '\0') return CMD_FAILED;
+
+  if (in_transaction) {
+    memset(&wrinfo, 0, sizeof(wrinfo));
+    wrinfo_cleared = true;
+  } else if (!write_locked()) {
+    memset(&devinfo, 0, sizeof(devinfo));
+    devinfo.checksum = compute_checksum(&devinfo);
+    devinfo_damaged = false;
+    update_devinfo();
+  } else {
+    return CMD_LOCKED;
+  }
+
+  return CMD_OK;
+}
+
+// Start staging writes. A BEGIN in the middle of a transaction is ignored so
+// that nothing already staged is lost.
+enum cmd_result handle_begin(char* arg) {
+  if (*arg != '\0') return CMD_FAILED;
+
+  if (!in_transaction) {
+    wrinfo = devinfo;
+    wrinfo_cleared = false;
+    in_transaction = true;
+  }
+
+  return CMD_OK;
+}
+
+// Store everything staged since BEGIN with a single commit. Since this is an
+// explicit commit, it's written to flash right away.
+enum cmd_result handle_commit(char* arg) {
+  if (*arg != '\0' || !in_transaction) return CMD_FAILED;
+
+  in_transaction = false;
+  if (write_locked()) return CMD_LOCKED;
+  if (devinfo_damaged && !wrinfo_cleared) return CMD_FAILED;
+
+  devinfo = wrinfo;
+  devinfo.checksum = compute_checksum(&devinfo);
+  update_devinfo();
+  return flush_devinfo() ? CMD_OK : CMD_FAILED;
+}
+
+enum cmd_result handle_abort(char* arg) {
+  if (*arg != '\0') return CMD_FAILED;
+
+  in_transaction = false;
+  return CMD_OK;
+}
+
+// Switch to binary mode. See bin_byte().
+enum cmd_result handle_binary(char* arg) {
+  if (*arg != '\0') return CMD_FAILED;
+
+  binary_mode = true;
+  return CMD_OK;
+}
+
+/**
+ * @brief Check that the device info in flash matches its checksum, and that the
+ * slots matched theirs when they were loaded. Any pending changes are committed
+ * first, since it's what's actually in flash that's checked.
+ *
+ * @return The response to CHECK?, without the line ending.
+ */
+const char* check_devinfo(void) {
+  flush_devinfo();
+  flush_slots();
+
+  if (check_response == NULL) {
+    static struct device_info stored;
+    enum ecc_result ecc;
+    bool ok = read_devinfo(&stored, &ecc) == RECORD_VERSION &&
+              ecc != ECC_FAILED &&
+              compute_checksum(&stored) == stored.checksum;
+    check_response = ok ? "OK CRC32" : "ERR CRC32";
+  }
+
+  return slots_damaged() ? "ERR CRC32" : check_response;
+}
+
+enum cmd_result handle_check(char* arg) {
+  if (*arg != '?') return CMD_FAILED;
+
+  reply_line(check_devinfo());
+  return CMD_OK;
+}
+
+// Longest response to DUMP?.
+#define FIELD_DUMP_SIZE(name, member, size, access) +sizeof(name) + (size)
+#define DUMP_MAX_SIZE                                             \
+  (0 DEVINFO_FIELDS(FIELD_DUMP_SIZE) + sizeof("SERIAL=\n") - 1 + \
+   sizeof(board_id) - 1 + sizeof("CHECK=ERR CRC32\n") - 1 +      \
+   sizeof("END\n") - 1)
+
+_Static_assert(DUMP_MAX_SIZE < REPLY_MAX,
+               "the response to DUMP? doesn't fit in the response buffer");
+
+/**
+ * @brief Report every field, the serial number, and the result of CHECK? in
+ * one response, as NAME=VALUE lines followed by a line with just END. The
+ * whole response fits in the response buffer, so it goes out in one write.
+ */
+enum cmd_result handle_dump(char* arg) {
+  if (*arg != '?') return CMD_FAILED;
+
+  for (size_t i = 0; i < count_of(fields); ++i) {
+    reply_str(fields[i].name, fields[i].name_len);
+    reply_str("=", 1);
+    reply_line((const char*)&devinfo + fields[i].offset);
+  }
+  reply_str("SERIAL=", 7);
+  reply_line(board_id);
+  reply_str("CHECK=", 6);
+  reply_line(check_devinfo());
+  reply_str("END\n", 4);
+
+  return CMD_OK;
+}
+
+// Defined below, once the trie has been built from the list of commands.
+int find_command(const char* msg, size_t* len);
+int find_slot_field(const char* msg, size_t* len);
+
+// Write several fields at once with SET <field>=<value>;<field>=<value>;...
+// A ';' or backslash in a value is escaped with a backslash. Nothing is
+// written unless every field is valid, and then the fields are stored with a
+// single commit, just like a transaction.
+enum cmd_result handle_set(char* arg) {
+  static struct device_info info;
+
+  if (*arg++ != ' ') return CMD_FAILED;
+  if (!partial_write_allowed()) return CMD_FAILED;
+
+  info = in_transaction ? wrinfo : devinfo;
+  while (*arg != '\0') {
+    char* name = arg;
+    char* value = strchr(name, '=');
+    if (value == NULL) return CMD_FAILED;
+    *value++ = '\0';
+
+    size_t len;
+    int index = find_command(name, &len);
+    if (index < 0 || (size_t)index >= count_of(fields) ||
+        name[len] != '\0' || fields[index].access != FIELD_RW) {
+      return CMD_FAILED;
+    }
+    const struct field* f = &fields[index];
+
+    // Remove the escapes in place, up to the next unescaped ';'.
+    char* src = value;
+    char* dst = value;
+    while (*src != '\0' && *src != ';') {
+      if (*src == '\\' && src[1] != '\0') ++src;
+      *dst++ = *src++;
+    }
+    arg = (*src == ';') ? src + 1 : src;
+    *dst = '\0';
+
+    value[strnlen(value, f->size - 1)] = '\0';
+    strncpy((char*)&info + f->offset, value, f->size);
+  }
+
+  if (in_transaction) {
+    wrinfo = info;
+    return CMD_OK;
+  }
+  if (write_locked()) return CMD_LOCKED;
+
+  devinfo = info;
+  devinfo.checksum = compute_checksum(&devinfo);
+  update_devinfo();
+  return flush_devinfo() ? CMD_OK : CMD_FAILED;
+}
+
+// Slot commands: SLOT<n>:<field>=<value> and SLOT<n>:<field>?.
+enum cmd_result handle_slot(char* arg) {
+  char* end;
+  unsigned long slot = strtoul(arg, &end, 10);
+  size_t len;
+  int field = (*end == ':') ? find_slot_field(end + 1, &len) : -1;
+  if (end == arg || slot >= SLOT_COUNT || field < 0) return CMD_FAILED;
+
+  arg = end + 1 + len;
+  if (*arg == '=') {
+    if (write_locked()) return CMD_LOCKED;
+    if (slots_damaged()) return CMD_FAILED;
+
+    slot_set(slot, field, arg + 1);
+    update_slots();
+  } else if (*arg == '?') {
+    reply_line(slot_get(slot, field));
+  } else {
+    return CMD_FAILED;
+  }
+
+  return CMD_OK;
+}
+
+// Clear every slot. This is the only way to replace slots that are damaged in
+// flash.
+enum cmd_result handle_slot_clear(char* arg) {
+  if (*arg != '\0') return CMD_FAILED;
+  if (write_locked()) return CMD_LOCKED;
+
+  slots_clear();
+  update_slots();
+  return CMD_OK;
+}
+
+// Return the numbers of the slots where a field has a value, separated by
+// commas: FIND <field>=<value>?.
+enum cmd_result handle_find(char* arg) {
+  if (*arg++ != ' ') return CMD_FAILED;
+
+  size_t len;
+  int field = find_slot_field(arg, &len);
+  char* value = arg + len;
+  char* end = strrchr(arg, '?');
+  if (field < 0 || *value != '=' || end == NULL) return CMD_FAILED;
+
+  *end = '\0';
+  uint32_t mask = slot_find(field, value + 1);
+  const char* sep = "";
+  for (unsigned slot = 0; slot < SLOT_COUNT; ++slot) {
+    if (mask & (1u << slot)) {
+      reply("%s%u", sep, slot);
+      sep = ",";
+    }
+  }
+  reply("\n");
+
+  return CMD_OK;
+}
+
+// Key-value store commands. Keys can't contain '=', '?', or ','.
+enum cmd_result handle_kv_set(char* arg) {
+  if (*arg++ != ' ') return CMD_FAILED;
+
+  char* value = strchr(arg, '=');
+  if (value == NULL) return CMD_FAILED;
+  if (write_locked()) return CMD_LOCKED;
+
+  *value++ = '\0';
+  return kv_set(arg, value) ? CMD_OK : CMD_FAILED;
+}
+
+enum cmd_result handle_kv_get(char* arg) {
+  if (*arg++ != ' ') return CMD_FAILED;
+
+  char* end = strchr(arg, '?');
+  if (end == NULL) return CMD_FAILED;
+
+  *end = '\0';
+  size_t len = 0;
+  const char* value = kv_get(arg, &len);
+  reply("%.*s\n", (int)len, (value != NULL) ? value : "");
+  return CMD_OK;
+}
+
+enum cmd_result handle_kv_del(char* arg) {
+  if (*arg++ != ' ') return CMD_FAILED;
+
+  if (write_locked()) return CMD_LOCKED;
+
+  return kv_del(arg) ? CMD_OK : CMD_FAILED;
+}
+
+enum cmd_result handle_kv_list(char* arg) {
+  if (*arg != '?') return CMD_FAILED;
+
+  size_t pos = 0;
+  size_t len;
+  const char* sep = "";
+  for (const char* key; (key = kv_next(&pos, &len)) != NULL; sep = ",") {
+    reply("%s%.*s", sep, (int)len, key);
+  }
+  reply("\n");
+
+  return CMD_OK;
+}
+
+// Blob commands. Uploads are started with BLOB.BEGIN <size>,<crc>, with the
+// CRC-32 in hex, then sent in order with BLOB.WRITE <offset>,<hex data>.
+enum cmd_result handle_blob_begin(char* arg) {
+  if (*arg++ != ' ') return CMD_FAILED;
+
+  char* end;
+  unsigned long size = strtoul(arg, &end, 10);
+  if (*end != ',') return CMD_FAILED;
+  if (write_locked()) return CMD_LOCKED;
+
+  return blob_begin(size, strtoul(end + 1, NULL, 16)) ? CMD_OK : CMD_FAILED;
+}
+
+enum cmd_result handle_blob_write(char* arg) {
+  static uint8_t chunk[BLOB_CHUNK_MAX];
+
+  if (*arg++ != ' ') return CMD_FAILED;
+
+  char* end;
+  unsigned long offset = strtoul(arg, &end, 10);
+  if (*end != ',') return CMD_FAILED;
+  if (write_locked()) return CMD_LOCKED;
+
+  int len = decode_hex(end + 1, chunk, sizeof(chunk));
+  if (len < 0 || !blob_write(offset, chunk, len)) return CMD_FAILED;
+  return CMD_OK;
+}
+
+// Report the upload's progress as RECEIVED/SIZE, so that an interrupted upload
+// knows where to carry on from.
+enum cmd_result handle_blob_upload(char* arg) {
+  if (*arg != '?') return CMD_FAILED;
+
+  size_t received, size;
+  if (blob_upload_status(&received, &size) == BLOB_UPLOAD_BAD_CRC) {
+    reply("ERR CRC32\n");
+  } else {
+    reply("%lu/%lu\n", (unsigned long)received, (unsigned long)size);
+  }
+
+  return CMD_OK;
+}
+
+// Read part of the blob as hex with BLOB.READ <offset>,<length>?.
+enum cmd_result handle_blob_read(char* arg) {
+  if (*arg++ != ' ') return CMD_FAILED;
+
+  char* end;
+  size_t offset = strtoul(arg, &end, 10);
+  size_t len = (*end == ',') ? strtoul(end + 1, &end, 10) : 0;
+  if (*end != '?') return CMD_FAILED;
+
+  const uint8_t* data;
+  size_t n = len;
+  while (len > 0 && (data = blob_read(offset, &n)) != NULL) {
+    for (size_t i = 0; i < n; ++i) {
+      reply("%02X", data[i]);
+    }
+    offset += n;
+    len -= n;
+    n = len;
+  }
+  reply("\n");
+
+  return CMD_OK;
+}
+
+enum cmd_result handle_blob(char* arg) {
+  if (*arg != '?') return CMD_FAILED;
+
+  size_t size = 0;
+  uint32_t crc = 0;
+  blob_info(&size, &crc);
+  reply("SIZE:%lu,CRC:%08lX\n", (unsigned long)size, (unsigned long)crc);
+
+  return CMD_OK;
+}
+
+#if PICO_IDENT_SCRUB
+#define SCRUB_COMMANDS(X)                 \
+  X("SCRUB", handle_scrub, QUERY)         \
+  X("SCRUB.LOG", handle_scrub_log, QUERY)
+#else
+#define SCRUB_COMMANDS(X)
+#endif
 
 /*
- * Offset 512K from the start of the flash.
- * Must be aligned to a 4096-byte sector.
- *
- * Note that this could cause issues if this program was larger than 512K, but
- * since this program is only ~30K (last I checked), it shouldn't be an issue.
+ * Every command other than the fields, with its handler. A name can be a
+ * prefix of another one (like BLOB and BLOB.READ), in which case the longest
+ * name that matches wins. Commands that are only in some builds go last, so
+ * that the IDs of the rest in binary mode don't change.
  */
-#define FLASH_TARGET_OFFSET (512 * 1024)
+#define COMMANDS(X)                           \
+  X("SERIAL", handle_serial, QUERY)           \
+  X("BOOT", handle_boot, QUERY)               \
+  X("FORMAT", handle_format, QUERY)           \
+  X("HEALTH", handle_health, QUERY)           \
+  X("SCHEMA", handle_schema, QUERY)           \
+  X("CLEAR", handle_clear, ACTION)            \
+  X("BEGIN", handle_begin, ACTION)            \
+  X("COMMIT", handle_commit, ACTION)          \
+  X("ABORT", handle_abort, ACTION)            \
+  X("CHECK", handle_check, QUERY)             \
+  X("SLOT", handle_slot, ACTION)              \
+  X("FIND", handle_find, ACTION)              \
+  X("KV.SET", handle_kv_set, ACTION)          \
+  X("KV.GET", handle_kv_get, ACTION)          \
+  X("KV.DEL", handle_kv_del, ACTION)          \
+  X("KV.LIST", handle_kv_list, QUERY)         \
+  X("BLOB.BEGIN", handle_blob_begin, ACTION)  \
+  X("BLOB.WRITE", handle_blob_write, ACTION)  \
+  X("BLOB.UPLOAD", handle_blob_upload, QUERY) \
+  X("BLOB.READ", handle_blob_read, ACTION)    \
+  X("BLOB", handle_blob, QUERY)               \
+  X("BINARY", handle_binary, ACTION)          \
+  X("DUMP", handle_dump, QUERY)               \
+  X("SET", handle_set, ACTION)                \
+  X("SLOT.CLEAR", handle_slot_clear, ACTION)  \
+  SCRUB_COMMANDS(X)
+
+#define COMMAND_ENTRY(name, handler, kind) {name, handler, COMMAND_##kind},
+#define COMMAND_NAME_LEN(name, handler, kind) +sizeof(name) - 1
+#define FIELD_NAME_LEN(name, member, size, access) +sizeof(name) - 1
+#define SLOT_NAME_LEN(name, member, size) +sizeof(name) - 1
+#define SLOT_NAME(name, member, size) name,
+
+enum command_kind {
+  // Answers a query, like HEALTH?, so it can be run with BIN_GET.
+  COMMAND_QUERY,
+  // Does something else, or needs more than a question mark after its name.
+  COMMAND_ACTION,
+};
+
+static const struct command {
+  const char* name;
+  enum cmd_result (*handler)(char* arg);
+  enum command_kind kind;
+} commands[] = {COMMANDS(COMMAND_ENTRY)};
 
 /*
- * This is the structure containing the info to store.
+ * The names of the fields and commands are looked up in a trie, so finding the
+ * command in a message takes one step per character of its name no matter how
+ * many commands there are. Each node is a character, with its children in a
+ * linked list. The root is node 0, so 0 also marks the end of a list.
  *
- * Each of the strings in this structure is assumed to be null-terminated.
+ * The names of the slot fields share the same nodes under a second root, node
+ * 1, since they overlap with the names of the device's own fields.
+ *
+ * The trie is built once at boot from the tables above, and it's sized at
+ * compile time to hold every character of every name.
  */
-struct device_info {
-  char mfg[64];
-  char name[64];
-  char ver[64];
-  char date[64];
-  char part[64];
-  char mfgserial[64];
-  char user1[64];
-  char user2[64];
-  char user3[64];
-  char user4[64];
-
-  // This checksum field is calculated by summing up all of the previous bytes
-  // in this structure. It's crude, but should be good enough for such a basic
-  // device.
-  uint8_t checksum;
+struct trie_node {
+  char c;
+  // If a name ends at this node, 1 + its index (the fields come first, then
+  // the commands, or the index of the slot field). Otherwise 0.
+  uint8_t match;
+  uint16_t child;
+  uint16_t sibling;
 };
 
-// Size of the device info structure + additional space to make it a multiple of
-// the flash page size (all writes must be whole numbers of pages).
-#define DEVINFO_SIZE                                    \
-  (((sizeof(struct device_info) / FLASH_PAGE_SIZE) +    \
-    !!(sizeof(struct device_info) % FLASH_PAGE_SIZE)) * \
-   FLASH_PAGE_SIZE)
+#define TRIE_SIZE                                                 \
+  (2 DEVINFO_FIELDS(FIELD_NAME_LEN) COMMANDS(COMMAND_NAME_LEN) \
+       SLOT_FIELDS(SLOT_NAME_LEN))
 
-// Device info in flash (read-only, you cannot write through this pointer).
-const struct device_info* flash_devinfo =
-    (const struct device_info*)(XIP_BASE + FLASH_TARGET_OFFSET);
+// Roots of the command and slot field names.
+#define COMMAND_ROOT (0)
+#define SLOT_ROOT (1)
 
-// Board ID (this is set only once and stored here).
-char board_id[PICO_UNIQUE_BOARD_ID_SIZE_BYTES * 2 + 1];
+_Static_assert(count_of(fields) + count_of(commands) < 256,
+               "too many commands for the trie");
+_Static_assert(TRIE_SIZE <= 65536, "command names don't fit in the trie");
+
+static struct trie_node trie[TRIE_SIZE];
+static size_t trie_used = 2;
 
 /**
- * @brief Commit a device info structure to flash.
+ * @brief Add a name to the trie.
+ *
+ * @param[in] root the root to add it under
+ * @param[in] name the name (null-terminated)
+ * @param[in] index the index of the field or command
+ */
+void trie_insert(uint16_t root, const char* name, size_t index) {
+  uint16_t node = root;
+
+  for (; *name != '\0'; ++name) {
+    uint16_t* link = &trie[node].child;
+    while (*link != 0 && trie[*link].c != *name) {
+      link = &trie[*link].sibling;
+    }
+    if (*link == 0) {
+      *link = trie_used++;
+      trie[*link].c = *name;
+    }
+    node = *link;
+  }
+
+  trie[node].match = index + 1;
+}
+
+/**
+ * @brief Build the command trie. This must be called once at boot before any
+ * messages are handled.
+ */
+void init_commands(void) {
+  static const char* const slot_names[] = {SLOT_FIELDS(SLOT_NAME)};
+
+  for (size_t i = 0; i < count_of(fields); ++i) {
+    trie_insert(COMMAND_ROOT, fields[i].name, i);
+  }
+  for (size_t i = 0; i < count_of(commands); ++i) {
+    trie_insert(COMMAND_ROOT, commands[i].name, count_of(fields) + i);
+  }
+  for (size_t i = 0; i < count_of(slot_names); ++i) {
+    trie_insert(SLOT_ROOT, slot_names[i], i);
+  }
+}
+
+/**
+ * @brief Take one step through the command trie.
  *
- * This function will erase the sector containing the data and then copy the
- * device info data into the cleared space. Note that if the WRLOCK_IN pin is
- * asserted, this function is a no-op.
+ * @param[in] node the current node
+ * @param[in] c the next character of the name
  *
- * @todo It may not be necessary to erase at all--it is probably enough to
- * simply write over the existing data.
+ * @return The child of node for c, or 0 if there isn't one.
+ */
+uint16_t trie_next(uint16_t node, char c) {
+  uint16_t next = trie[node].child;
+  while (next != 0 && trie[next].c != c) {
+    next = trie[next].sibling;
+  }
+  return next;
+}
+
+/**
+ * @brief Find the longest name in the trie at the start of a message.
  *
- * @param[in] info a pointer to a device info struct to store
+ * @param[in] root the root to look under
+ * @param[in] msg the message (null-terminated)
+ * @param[out] len set to the length of the name that was found (0 if none)
+ *
+ * @return The index of the name, or -1 if there isn't one.
  */
-void store_devinfo(const struct device_info* info) {
-  if (!gpio_get(WRLOCK_IN)) {
-    // TODO: do we even need to erase here? This might be redundant.
-    uint32_t ints = save_and_disable_interrupts();
-    flash_range_erase(FLASH_TARGET_OFFSET, FLASH_SECTOR_SIZE);
-    restore_interrupts(ints);
+int trie_find(uint16_t root, const char* msg, size_t* len) {
+  uint16_t node = root;
+  int match = -1;
 
-    if (info != NULL) {
-      static uint8_t buf[DEVINFO_SIZE] = {0};
-      memcpy(buf, info, sizeof(*info));
+  *len = 0;
+  for (size_t i = 0; msg[i] != '\0'; ++i) {
+    node = trie_next(node, msg[i]);
+    if (node == 0) break;
 
-      ints = save_and_disable_interrupts();
-      flash_range_program(FLASH_TARGET_OFFSET, buf, DEVINFO_SIZE);
-      restore_interrupts(ints);
+    if (trie[node].match != 0) {
+      match = trie[node].match - 1;
+      *len = i + 1;
     }
   }
+
+  return match;
 }
 
 /**
- * @brief Compute the 8-bit checksum of a device info structure.
+ * @brief Find the longest field or command name at the start of a message.
  *
- * @param[in] info the structure to use
+ * @param[in] msg the message (null-terminated)
+ * @param[out] len set to the length of the name that was found
  *
- * @return The 8-bit checksum of the structure.
+ * @return The index of the field or command, or -1 if there isn't one.
  */
-uint8_t compute_checksum(const struct device_info* info) {
-  if (info != NULL) {
-    uint8_t sum = 0;
-    const uint8_t* bytes = (const uint8_t*)info;
+int find_command(const char* msg, size_t* len) {
+  return trie_find(COMMAND_ROOT, msg, len);
+}
 
-    for (size_t i = 0; i < (sizeof(*info) - 1); ++i) {
-      sum += bytes[i];
-    }
+/**
+ * @brief Find the slot field name at the start of a message.
+ *
+ * @param[in] msg the message (null-terminated)
+ * @param[out] len set to the length of the name that was found
+ *
+ * @return The index of the slot field, or -1 if there isn't one.
+ */
+int find_slot_field(const char* msg, size_t* len) {
+  return trie_find(SLOT_ROOT, msg, len);
+}
 
-    return sum;
+/**
+ * @brief Run a field or command.
+ *
+ * @param[in] index the index of the field or command
+ * @param[in,out] arg the rest of the message after its name
+ *
+ * @return Whether the field or command succeeded.
+ */
+enum cmd_result dispatch(int index, char* arg) {
+  if (first_msg_us == 0) {
+    first_msg_us = to_us_since_boot(get_absolute_time());
   }
 
-  return 0;
+  if ((size_t)index < count_of(fields)) {
+    return handle_field(arg, index);
+  }
+  return commands[index - count_of(fields)].handler(arg);
 }
 
+/*
+ * Longest argument (everything after the command name) the lexer can hold.
+ */
+#define ARG_MAX (511)
+
+/*
+ * State of the lexer, which handles messages a byte at a time as they arrive.
+ * The command name is looked up in the trie as it comes in, so only the rest of
+ * the message is buffered, and the command is ready to run as soon as the
+ * carriage return arrives.
+ */
+struct lexer {
+  // Set until the name can't go any further in the trie, and the node reached
+  // in the trie so far.
+  bool in_name;
+  uint16_t node;
+  // Longest field or command matched so far, or -1.
+  int match;
+  // Everything received since the end of the longest name matched so far.
+  char arg[ARG_MAX + 1];
+  size_t len;
+  // Set once any part of a message has been received.
+  bool busy;
+  // Set if the message was too long or had a byte that isn't allowed. The
+  // whole message is rejected, with an error in place of its response.
+  const char* error;
+} lex = {.in_name = true, .match = -1};
+
 /**
- * @brief Validate the device info in flash and update it if necessary to clear
- * any invalid data. This function is to be run once at boot.
+ * @brief Feed one byte from the serial port to the lexer, and handle the
+ * message once its carriage return arrives.
  *
- * On startup with a new pico, it's entirely possible for the flash to be in its
- * erased state (filled with FFs). This, of course, does not equate to
- * a zero-length string. This function checks the device info stored in flash to
- * make sure that it doesn't contain any FFs. If any field does, it will be
- * zeroed out. This case should only arise on a fresh flash.
+ * @param[in] c the byte
  */
-void validate_devinfo(void) {
-  struct device_info devinfo = *flash_devinfo;
+void lex_byte(char c) {
+  if (c == '\r') {
+    if (lex.error != NULL) {
+      reply_line(lex.error);
+    } else if (lex.match >= 0) {
+      lex.arg[lex.len] = '\0';
+      dispatch(lex.match, lex.arg);
+    }
+    send_reply();
 
-  // We can be smart about this: any set field is guaranteed not to contain any
-  // FF bytes, as strncpy will have zero-filled it. Any field containing an
-  // invalid byte is therefore invalid.
-#define VAL_FIELD(field, n)                         \
-  do {                                              \
-    if (memchr(devinfo.field, 0xFF, (n)) != NULL) { \
-      memset(devinfo.field, '\0', (n));             \
-    }                                               \
-  } while (0)
-
-  VAL_FIELD(mfg, 64);
-  VAL_FIELD(name, 64);
-  VAL_FIELD(ver, 64);
-  VAL_FIELD(date, 64);
-  VAL_FIELD(part, 64);
-  VAL_FIELD(mfgserial, 64);
-  VAL_FIELD(user1, 64);
-  VAL_FIELD(user2, 64);
-  VAL_FIELD(user3, 64);
-  VAL_FIELD(user4, 64);
-
-  if (memcmp(&devinfo, flash_devinfo, sizeof(devinfo)) != 0) {
-    devinfo.checksum = compute_checksum(&devinfo);
-    store_devinfo(&devinfo);
-  }
-}
-
-/**
- * @brief Handle and respond to serial messages.
- *
- * The input string may be modified to add a null terminator to trim a value to
- * length, so the caller should not rely on the string containing no embedded
- * nulls.
- *
- * @param[in,out] msg a null-terminated string containing the message to handle
- */
-void handle_msg(char* msg) {
-  if (msg == NULL) return;
-
-  static struct device_info wrinfo;
-
-  // This macro is used to define set/get commands for specific fields. This is
-  // just to avoid the massive block of ugly code we had here before, at the
-  // expense of a tiny bit of maintainability.
-  // GCC will optimize out the strlens here (in fact when confirming this I was
-  // unable to make it *not* optimize them out).
-#define RW_FIELD(fname, field, len)                                 \
-  do {                                                              \
-    if (strncmp(msg, (fname "="), strlen(fname "=")) == 0) {        \
-      msg += strlen(fname "=");                                     \
-      msg[strnlen(msg, (len)-1)] = '\0';                            \
-      wrinfo = *flash_devinfo;                                      \
-      strncpy(wrinfo.field, msg, (len));                            \
-      wrinfo.checksum = compute_checksum(&wrinfo);                  \
-      store_devinfo(&wrinfo);                                       \
-      return;                                                       \
-    } else if (strncmp(msg, (fname "?"), strlen(fname "?")) == 0) { \
-      printf("%s\n", flash_devinfo->field);                         \
-      return;                                                       \
-    }                                                               \
-  } while (0)
-
-  RW_FIELD("MFG", mfg, 64);
-  RW_FIELD("NAME", name, 64);
-  RW_FIELD("VER", ver, 64);
-  RW_FIELD("DATE", date, 64);
-  RW_FIELD("PART", part, 64);
-  RW_FIELD("MFGSERIAL", mfgserial, 64);
-  RW_FIELD("USER1", user1, 64);
-  RW_FIELD("USER2", user2, 64);
-  RW_FIELD("USER3", user3, 64);
-  RW_FIELD("USER4", user4, 64);
-
-  if (strncmp(msg, "SERIAL?", 7) == 0) {
-    printf("%s\n", board_id);
+    lex.in_name = true;
+    lex.node = 0;
+    lex.match = -1;
+    lex.len = 0;
+    lex.busy = false;
+    lex.error = NULL;
     return;
   }
 
-  if (strncmp(msg, "CLEAR", 5) == 0) {
-    memset(&wrinfo, 0, sizeof(wrinfo));
-    store_devinfo(&wrinfo);
+  // Line feeds are allowed after the carriage return, so they're ignored.
+  if (c == '\n') return;
+
+  lex.busy = true;
+  if (lex.error != NULL) return;
+
+  if (!isprint((unsigned char)c)) {
+    lex.error = "ERR INVALID";
+    return;
+  }
+
+  // Follow the name through the trie for as long as it goes. Anything past the
+  // longest name matched is kept, since the name may not go any further.
+  if (lex.in_name) {
+    lex.node = trie_next(lex.node, c);
+    if (lex.node == 0) {
+      lex.in_name = false;
+    } else if (trie[lex.node].match != 0) {
+      lex.match = trie[lex.node].match - 1;
+      lex.len = 0;
+      return;
+    }
+  }
+
+  // Field values go straight into the buffer, and anything past the end of
+  // the field is dropped.
+  if (!lex.in_name && lex.match >= 0 && (size_t)lex.match < count_of(fields) &&
+      lex.len >= fields[lex.match].size) {
     return;
   }
 
-  if (strncmp(msg, "CHECK?", 6) == 0) {
-    uint8_t sum = compute_checksum(flash_devinfo);
-    if (sum == flash_devinfo->checksum) {
-      printf("OK\n");
+  if (lex.len == ARG_MAX) {
+    lex.error = "ERR OVERFLOW";
+    return;
+  }
+  lex.arg[lex.len++] = c;
+}
+
+/*
+ * In binary mode, each request and response is a frame encoded with COBS and
+ * ended with a zero byte. Once decoded, a request is made up of:
+ *
+ *  - the ID of the field or command (1 byte)
+ *  - the opcode (1 byte, enum bin_opcode)
+ *  - the length of the payload (2 bytes, little-endian), then the payload
+ *  - the CRC-16 of everything before it (2 bytes, little-endian)
+ *
+ * A response has the same layout, with a status (enum bin_status) in place of
+ * the opcode. Every request gets a response, even if it has no payload.
+ *
+ * IDs are numbered as in the trie: the fields in order from 0, then the
+ * commands. Requests are run by the same handlers as text commands, and the
+ * payload of a response is the same text without the line ending.
+ */
+enum bin_opcode {
+  // Go back to text mode.
+  BIN_EXIT = 0,
+  // Query a field or run a query command, like NAME?.
+  BIN_GET = 1,
+  // Set a field to the payload, like NAME=value.
+  BIN_SET = 2,
+  // Run a command with the payload as everything after its name.
+  BIN_CALL = 3,
+  // Look up the ID of the field or command named in the payload. The ID is
+  // returned as a 1-byte payload.
+  BIN_LOOKUP = 4,
+};
+
+enum bin_status {
+  BIN_OK = 0,
+  // The frame couldn't be decoded, or its length didn't match.
+  BIN_BAD_FRAME = 1,
+  BIN_BAD_CRC = 2,
+  // There's no field or command with that ID.
+  BIN_BAD_ID = 3,
+  // The opcode doesn't exist or can't be used with that field or command.
+  BIN_BAD_OPCODE = 4,
+  // Writing is locked.
+  BIN_LOCKED = 5,
+  // The request or response was too long.
+  BIN_OVERFLOW = 6,
+  // The payload has a byte that isn't a printable ASCII character.
+  BIN_INVALID = 7,
+  // The field or command failed, e.g. because its argument was malformed.
+  BIN_FAILED = 8,
+};
+
+// Size of the ID, opcode or status, and length, and of the CRC-16.
+#define BIN_HEADER_SIZE (4)
+#define BIN_CRC_SIZE (2)
+
+// Longest request payload, leaving room in the argument buffer for the '=' of
+// BIN_SET and a null terminator.
+#define BIN_PAYLOAD_MAX (ARG_MAX - 1)
+
+/*
+ * State of the binary receiver. Encoded bytes are collected until the zero
+ * byte that ends the frame, and then decoded in place.
+ */
+struct bin_receiver {
+  uint8_t buf[COBS_MAX_ENCODED(BIN_HEADER_SIZE + BIN_PAYLOAD_MAX +
+                               BIN_CRC_SIZE)];
+  size_t len;
+  // Set if the frame didn't fit in buf.
+  bool overflow;
+} bin;
+
+/**
+ * @brief Send a response frame in binary mode.
+ *
+ * @param[in] id the ID from the request
+ * @param[in] status the status
+ * @param[in] payload the payload
+ * @param[in] len the length of the payload in bytes
+ */
+void send_frame(uint8_t id, enum bin_status status, const void* payload,
+                size_t len) {
+  static uint8_t raw[BIN_HEADER_SIZE + REPLY_MAX + BIN_CRC_SIZE];
+  static uint8_t frame[COBS_MAX_ENCODED(sizeof(raw)) + 1];
+
+  raw[0] = id;
+  raw[1] = status;
+  raw[2] = len & 0xFF;
+  raw[3] = len >> 8;
+  memcpy(raw + BIN_HEADER_SIZE, payload, len);
+
+  uint16_t crc = crc16(raw, BIN_HEADER_SIZE + len);
+  raw[BIN_HEADER_SIZE + len] = crc & 0xFF;
+  raw[BIN_HEADER_SIZE + len + 1] = crc >> 8;
+
+  size_t n = cobs_encode(raw, BIN_HEADER_SIZE + len + BIN_CRC_SIZE, frame);
+  frame[n++] = 0;
+
+  // The frame is binary, so it mustn't go through the CR/LF translation that
+  // stdout does.
+  for (size_t i = 0; i < n; ++i) {
+    putchar_raw(frame[i]);
+  }
+  stdio_flush();
+}
+
+/**
+ * @brief Handle a request frame in binary mode.
+ *
+ * @param[in,out] frame the decoded frame
+ * @param[in] len the length of the frame in bytes
+ *
+ * @return The status to respond with. On success, the response is in out.
+ */
+enum bin_status handle_frame(const uint8_t* frame, size_t len) {
+  if (len < BIN_HEADER_SIZE + BIN_CRC_SIZE) return BIN_BAD_FRAME;
+
+  uint8_t id = frame[0];
+  uint8_t opcode = frame[1];
+  size_t size = frame[2] | (frame[3] << 8);
+  const uint8_t* payload = frame + BIN_HEADER_SIZE;
+  if (size != len - BIN_HEADER_SIZE - BIN_CRC_SIZE) return BIN_BAD_FRAME;
+
+  uint16_t crc = frame[len - 2] | (frame[len - 1] << 8);
+  if (crc != crc16(frame, len - BIN_CRC_SIZE)) return BIN_BAD_CRC;
+
+  if (opcode == BIN_EXIT) {
+    binary_mode = false;
+    return BIN_OK;
+  }
+
+  if (opcode == BIN_LOOKUP) {
+    char* name = lex.arg;
+    size_t name_len;
+    if (size > ARG_MAX) return BIN_BAD_ID;
+    memcpy(name, payload, size);
+    name[size] = '\0';
+
+    int index = find_command(name, &name_len);
+    if (index < 0 || name_len != size) return BIN_BAD_ID;
+    out.buf[0] = index;
+    out.len = 1;
+    return BIN_OK;
+  }
+
+  if (id >= count_of(fields) + count_of(commands)) return BIN_BAD_ID;
+  if (size > BIN_PAYLOAD_MAX) return BIN_OVERFLOW;
+
+  // Payloads become the same text a command would have, so they're held to
+  // the same rules.
+  for (size_t i = 0; i < size; ++i) {
+    if (!isprint(payload[i])) return BIN_INVALID;
+  }
+
+  // Build the same argument the text command would have.
+  char* arg = lex.arg;
+  switch (opcode) {
+    case BIN_GET:
+      if (id >= count_of(fields) &&
+          commands[id - count_of(fields)].kind != COMMAND_QUERY) {
+        return BIN_BAD_OPCODE;
+      }
+      strcpy(arg, "?");
+      break;
+    case BIN_SET:
+      if (id >= count_of(fields) || fields[id].access != FIELD_RW) {
+        return BIN_BAD_OPCODE;
+      }
+      if (write_locked()) return BIN_LOCKED;
+      arg[0] = '=';
+      memcpy(arg + 1, payload, size);
+      arg[size + 1] = '\0';
+      break;
+    case BIN_CALL:
+      memcpy(arg, payload, size);
+      arg[size] = '\0';
+      break;
+    default:
+      return BIN_BAD_OPCODE;
+  }
+
+  enum cmd_result result = dispatch(id, arg);
+  if (result == CMD_LOCKED) return BIN_LOCKED;
+  if (result == CMD_FAILED) return BIN_FAILED;
+  if (out.overflow) return BIN_OVERFLOW;
+
+  // The line ending of text responses isn't needed in a frame.
+  if (out.len > 0 && out.buf[out.len - 1] == '\n') --out.len;
+  return BIN_OK;
+}
+
+/**
+ * @brief Feed one byte from the serial port to the binary receiver, and
+ * handle the frame once the zero byte that ends it arrives.
+ *
+ * @param[in] c the byte
+ */
+void bin_byte(uint8_t c) {
+  if (c != 0) {
+    if (bin.len < sizeof(bin.buf)) {
+      bin.buf[bin.len++] = c;
     } else {
-      printf("ERR\n");
+      bin.overflow = true;
     }
     return;
   }
+
+  // An empty frame is ignored, so a zero byte can always be sent to get back
+  // in step with the frames.
+  if (bin.len > 0) {
+    enum bin_status status;
+    size_t len;
+
+    if (bin.overflow) {
+      status = BIN_OVERFLOW;
+    } else if (!cobs_decode(bin.buf, bin.len, bin.buf, &len)) {
+      status = BIN_BAD_FRAME;
+    } else {
+      status = handle_frame(bin.buf, len);
+    }
+
+    // Only the request's ID is echoed back if the request was malformed, since
+    // that's all there is to go on.
+    uint8_t id = bin.overflow ? 0 : bin.buf[0];
+
+    if (status != BIN_OK) out.len = 0;
+    send_frame(id, status, out.buf, out.len);
+  }
+
+  bin.len = 0;
+  bin.overflow = false;
+  out.len = 0;
+  out.overflow = false;
 }
 
 int main(void) {
@@ -246,28 +1876,77 @@ int main(void) {
   bi_decl(bi_2pins_with_names(WRLOCK_IN, "Write lock in", WRLOCK_OUT,
                               "Write lock out"));
 
-  // Make sure the data in flash is valid
-  validate_devinfo();
+  // Let picotool know where the stored data is.
+  bi_decl(bi_block_device(BINARY_INFO_MAKE_TAG('B', 'C'), "pico-ident data",
+                          (uint32_t)__storage_start, STORAGE_SIZE, NULL,
+                          BINARY_INFO_BLOCK_DEV_FLAG_READ |
+                              BINARY_INFO_BLOCK_DEV_FLAG_WRITE |
+                              BINARY_INFO_BLOCK_DEV_FLAG_PT_UNKNOWN));
+
+  // Find the data in flash and make sure it's valid. If it needs to be stored
+  // again, that's left to the main loop so that it doesn't hold up the first
+  // command.
+  storage_init();
+  journal_init(&devinfo_journal);
+  if (load_devinfo()) {
+    update_devinfo();
+  }
+  kv_init();
+  blob_init();
+  slots_init();
+
+  init_commands();
 
   // Get the board ID (we only need to do this once)
   pico_get_unique_board_id_string(board_id, sizeof(board_id));
 
-  char rdbuf[512] = {0};
-  size_t idx = 0;
+#if PICO_IDENT_SCRUB
+  scrub_start(scrub_devinfo);
+#endif
+
+  ready_us = to_us_since_boot(get_absolute_time());
+
   int c;
   while (1) {
     c = getchar_timeout_us(10);
-    if (c == PICO_ERROR_TIMEOUT) continue;
-
-    // If it's a return character, handle the message. If not, add it to the
-    // buffer so long as it's valid.
-    if (c == '\r') {
-      rdbuf[idx] = '\0';
-      idx = 0;
-      handle_msg(rdbuf);
-    } else if (isprint(c)) {
-      rdbuf[idx] = c;
-      idx = (idx + 1) % sizeof(rdbuf);
+
+    // Commit pending changes once the host has gone quiet for a bit, as long
+    // as it isn't partway through sending a command. Nothing that arrives can
+    // hold them back for longer than COMMIT_MAX_DELAY_US, though.
+    if (devinfo_dirty || slots_dirty) {
+      absolute_time_t now = get_absolute_time();
+      bool quiet = c == PICO_ERROR_TIMEOUT && !lex.busy && bin.len == 0 &&
+                   absolute_time_diff_us(last_change, now) >= COMMIT_DELAY_US;
+      if (quiet ||
+          absolute_time_diff_us(first_change, now) >= COMMIT_MAX_DELAY_US) {
+        flush_devinfo();
+        flush_slots();
+      }
+    }
+
+    if (c == PICO_ERROR_TIMEOUT) {
+#if PICO_IDENT_SCRUB
+      // Let the scrubber run while there's nothing else to do, repairing
+      // anything it found first.
+      if (!devinfo_dirty && !slots_dirty && !lex.busy && bin.len == 0) {
+        if (scrub_repair_needed() && repair_devinfo()) {
+          scrub_repaired();
+        } else {
+          scrub_resume();
+        }
+      }
+#endif
+      continue;
+    }
+
+#if PICO_IDENT_SCRUB
+    scrub_pause();
+#endif
+
+    if (binary_mode) {
+      bin_byte(c);
+    } else {
+      lex_byte(c);
     }
   }
 }
@@ -0,0 +1,116 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+#include "scrub.h"
+
+#include "pico/flash.h"
+#include "pico/multicore.h"
+#include "pico/stdlib.h"
+
+static scrub_check_fn check_fn = NULL;
+
+// Set by core0 to stop the scrubber. Every pause also bumps the epoch, so
+// core1 can tell whether there was one while it was checking.
+static volatile bool paused = true;
+static volatile uint32_t epoch = 0;
+
+// Set by core1 when it finds a problem, and cleared by core0 when it repairs
+// it.
+static volatile bool repair = false;
+
+static struct scrub_stats stats = {0};
+
+// The last finding that was logged, until a check finds nothing wrong or core0
+// repairs it.
+static volatile enum scrub_finding known = SCRUB_OK;
+
+// Ring buffer of findings. Only core1 writes to it.
+static struct scrub_log_entry log_entries[SCRUB_LOG_SIZE];
+static volatile uint32_t log_count = 0;
+
+static void core1_main(void) {
+  // Let core0 pause this core while it's writing to flash.
+  flash_safe_execute_core_init();
+
+  absolute_time_t next = make_timeout_time_ms(SCRUB_INTERVAL_MS);
+  while (1) {
+    if (paused || repair || !time_reached(next)) {
+      sleep_ms(1);
+      continue;
+    }
+
+    uint32_t start = epoch;
+    enum scrub_finding finding = check_fn();
+
+    // If core0 paused the scrubber at any point, the check may have seen the
+    // data partway through a change, so throw it away.
+    if (paused || epoch != start) continue;
+
+    next = make_timeout_time_ms(SCRUB_INTERVAL_MS);
+    ++stats.passes;
+
+    if (finding == SCRUB_OK) {
+      known = SCRUB_OK;
+      continue;
+    }
+
+    // Core0 can't always repair a problem (e.g. while the write lock is on),
+    // so the same one can turn up on every check. Only log it once.
+    ++stats.errors;
+    if (finding != known) {
+      log_entries[log_count % SCRUB_LOG_SIZE] = (struct scrub_log_entry){
+          .time_ms = to_ms_since_boot(get_absolute_time()),
+          .finding = finding,
+      };
+      ++log_count;
+      known = finding;
+    }
+    repair = true;
+  }
+}
+
+void scrub_start(scrub_check_fn check) {
+  check_fn = check;
+  multicore_launch_core1(core1_main);
+}
+
+void scrub_pause(void) {
+  paused = true;
+  ++epoch;
+}
+
+void scrub_resume(void) { paused = false; }
+
+bool scrub_repair_needed(void) {
+  if (!repair) return false;
+
+  scrub_pause();
+  repair = false;
+
+  return true;
+}
+
+void scrub_repaired(void) {
+  known = SCRUB_OK;
+  ++stats.repairs;
+}
+
+void scrub_get_stats(struct scrub_stats* out) { *out = stats; }
+
+size_t scrub_get_log(struct scrub_log_entry* log) {
+  uint32_t count = log_count;
+  size_t n = (count < SCRUB_LOG_SIZE) ? count : SCRUB_LOG_SIZE;
+
+  for (size_t i = 0; i < n; ++i) {
+    log[i] = log_entries[(count - n + i) % SCRUB_LOG_SIZE];
+  }
+
+  return n;
+}
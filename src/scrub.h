@@ -0,0 +1,118 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+#ifndef PICO_IDENT_SCRUB_H
+#define PICO_IDENT_SCRUB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * How often the stored data is checked while the device is idle.
+ */
+#define SCRUB_INTERVAL_MS (1000)
+
+// Number of findings kept in the log.
+#define SCRUB_LOG_SIZE (8)
+
+/*
+ * What a check of the stored data found.
+ */
+enum scrub_finding {
+  // Nothing was wrong.
+  SCRUB_OK,
+  // There were errors, but they were corrected as the data was read.
+  SCRUB_CORRECTED,
+  // There were errors that couldn't be corrected.
+  SCRUB_UNCORRECTABLE,
+  // The stored data doesn't match the copy in RAM.
+  SCRUB_MISMATCH,
+};
+
+/*
+ * Function that checks the stored data. This runs on core1, so it must only
+ * read flash and shared state, and it must not use the DMA sniffer.
+ */
+typedef enum scrub_finding (*scrub_check_fn)(void);
+
+/*
+ * Scrub statistics since boot.
+ */
+struct scrub_stats {
+  // Number of checks completed.
+  uint32_t passes;
+  // Number of checks that found something wrong.
+  uint32_t errors;
+  // Number of times core0 repaired the stored data (or queued a repair).
+  uint32_t repairs;
+};
+
+/*
+ * An entry in the log of findings.
+ */
+struct scrub_log_entry {
+  // Time since boot of the check, in milliseconds.
+  uint32_t time_ms;
+  enum scrub_finding finding;
+};
+
+/**
+ * @brief Start the scrubber on core1. It starts out paused.
+ *
+ * @param[in] check the function that checks the stored data
+ */
+void scrub_start(scrub_check_fn check);
+
+/**
+ * @brief Stop the scrubber from checking anything until scrub_resume() is
+ * called. Any check already in progress is thrown away, so core0 doesn't need
+ * to wait for it before using or changing the stored data.
+ */
+void scrub_pause(void);
+
+/**
+ * @brief Let the scrubber check the stored data again.
+ */
+void scrub_resume(void);
+
+/**
+ * @brief Check whether the scrubber has found a problem that needs the stored
+ * data to be repaired. This returns true once for each check that found one,
+ * and the scrubber stays paused until it's resumed.
+ *
+ * @return True if the stored data needs to be repaired.
+ */
+bool scrub_repair_needed(void);
+
+/**
+ * @brief Tell the scrubber that the problem it found has been repaired, or a
+ * repair has been queued. Only these are counted as repairs. Until then, the
+ * same problem is only logged once, however many checks find it.
+ */
+void scrub_repaired(void);
+
+/**
+ * @brief Get the scrub statistics.
+ *
+ * @param[out] stats the structure to fill in
+ */
+void scrub_get_stats(struct scrub_stats* stats);
+
+/**
+ * @brief Get the log of findings that weren't SCRUB_OK, oldest first.
+ *
+ * @param[out] log buffer for the entries (at least SCRUB_LOG_SIZE)
+ *
+ * @return The number of entries.
+ */
+size_t scrub_get_log(struct scrub_log_entry* log);
+
+#endif  // PICO_IDENT_SCRUB_H
@@ -0,0 +1,198 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+#include "slots.h"
+
+#include <string.h>
+
+#include "crc.h"
+#include "pico/stdlib.h"
+
+#define SLOT_MEMBER(name, member, size) char member[size];
+#define SLOT_ENTRY(name, member, size) {offsetof(struct slot, member), (size)},
+#define SLOT_RECORD_SIZE(name, member, size) +2 + (size)-1
+
+/*
+ * The fields of a single slot. Each string is null-terminated.
+ */
+struct slot {
+  SLOT_FIELDS(SLOT_MEMBER)
+};
+
+static const struct field {
+  size_t offset;
+  size_t size;
+} fields[] = {SLOT_FIELDS(SLOT_ENTRY)};
+
+/*
+ * Header at the start of the record holding the slots. The CRC-32 covers
+ * everything after the header.
+ */
+struct slots_header {
+  uint16_t magic;
+  uint16_t version;
+  uint32_t crc;
+};
+
+#define SLOTS_MAGIC (0x534Cu)
+#define SLOTS_VERSION (1)
+
+/*
+ * After the header, each non-empty field of each slot is stored as a tag,
+ * length, and value. The tag holds the slot number in its upper 5 bits and the
+ * field's position in SLOT_FIELDS (starting at 1) in its lower 3 bits. The
+ * values are not null-terminated.
+ */
+#define FIELD_BITS (3)
+#define SLOTS_MAX_SIZE \
+  (sizeof(struct slots_header) + SLOT_COUNT * (0 SLOT_FIELDS(SLOT_RECORD_SIZE)))
+
+_Static_assert(count_of(fields) < (1 << FIELD_BITS), "too many slot fields");
+_Static_assert(SLOT_COUNT <= 32, "too many slots for the tags and slot_find()");
+_Static_assert(SLOTS_MAX_SIZE <= JOURNAL_MAX_LEN,
+               "slots don't fit in a journal sector");
+_Static_assert(JOURNAL_SECTORS + KV_SECTORS + 2 * BLOB_SECTORS +
+                       SLOTS_SECTORS <=
+                   STORAGE_SECTORS,
+               "the slots don't fit in STORAGE_SIZE");
+_Static_assert(SLOTS_SECTORS >= 2, "journal needs at least two sectors");
+
+static struct journal slots_journal = JOURNAL(SLOTS_OFFSET, SLOTS_SECTORS);
+
+static struct slot slots[SLOT_COUNT];
+
+// Whether the newest record in flash couldn't be read.
+static bool damaged = false;
+
+static char* field_ptr(unsigned slot, int field) {
+  return (char*)&slots[slot] + fields[field].offset;
+}
+
+// Decode a record into slots, ignoring any fields this firmware doesn't know
+// about.
+static bool decode_slots(const uint8_t* record, size_t len) {
+  struct slots_header hdr;
+
+  if (len < sizeof(hdr)) return false;
+  memcpy(&hdr, record, sizeof(hdr));
+  if (hdr.magic != SLOTS_MAGIC ||
+      hdr.crc != crc32(record + sizeof(hdr), len - sizeof(hdr))) {
+    return false;
+  }
+
+  size_t pos = sizeof(hdr);
+  while (pos + 2 <= len) {
+    unsigned slot = record[pos] >> FIELD_BITS;
+    unsigned tag = record[pos] & ((1 << FIELD_BITS) - 1);
+    size_t value_len = record[pos + 1];
+    pos += 2;
+    if (value_len > len - pos) return false;
+
+    if (slot < SLOT_COUNT && tag >= 1 && tag <= count_of(fields)) {
+      size_t n = value_len;
+      if (n > fields[tag - 1].size - 1) n = fields[tag - 1].size - 1;
+      memcpy(field_ptr(slot, tag - 1), record + pos, n);
+    }
+    pos += value_len;
+  }
+
+  return true;
+}
+
+// Encode the slots into a record, leaving out empty fields.
+static size_t encode_slots(uint8_t* buf) {
+  struct slots_header hdr = {
+      .magic = SLOTS_MAGIC,
+      .version = SLOTS_VERSION,
+  };
+  size_t pos = sizeof(hdr);
+
+  for (unsigned slot = 0; slot < SLOT_COUNT; ++slot) {
+    for (size_t i = 0; i < count_of(fields); ++i) {
+      const char* value = field_ptr(slot, i);
+      size_t len = strnlen(value, fields[i].size - 1);
+
+      if (len > 0) {
+        buf[pos++] = (slot << FIELD_BITS) | (i + 1);
+        buf[pos++] = len;
+        memcpy(buf + pos, value, len);
+        pos += len;
+      }
+    }
+  }
+
+  hdr.crc = crc32(buf + sizeof(hdr), pos - sizeof(hdr));
+  memcpy(buf, &hdr, sizeof(hdr));
+
+  return pos;
+}
+
+void slots_init(void) {
+  memset(slots, 0, sizeof(slots));
+
+  journal_init(&slots_journal);
+
+  // If the newest record can't be read, none of it is trusted. Its header could
+  // also have been the one that was damaged, leaving an older record as the
+  // newest.
+  size_t len;
+  const uint8_t* record = journal_latest(&slots_journal, &len);
+  damaged = journal_health(&slots_journal) == ECC_FAILED ||
+            (record != NULL && !decode_slots(record, len));
+  if (damaged) {
+    memset(slots, 0, sizeof(slots));
+  }
+}
+
+bool slots_damaged(void) { return damaged; }
+
+void slots_clear(void) {
+  memset(slots, 0, sizeof(slots));
+  damaged = false;
+}
+
+const char* slot_get(unsigned slot, int field) {
+  return field_ptr(slot, field);
+}
+
+void slot_set(unsigned slot, int field, const char* value) {
+  // strncpy() fills the rest of the field with nulls, and the last byte is
+  // never written, so the value is always null-terminated.
+  strncpy(field_ptr(slot, field), value, fields[field].size - 1);
+}
+
+uint32_t slot_find(int field, const char* value) {
+  uint32_t mask = 0;
+
+  for (unsigned slot = 0; slot < SLOT_COUNT; ++slot) {
+    if (strcmp(field_ptr(slot, field), value) == 0) {
+      mask |= 1u << slot;
+    }
+  }
+
+  return mask;
+}
+
+bool slots_store(void) {
+  static uint8_t buf[SLOTS_MAX_SIZE];
+
+  if (damaged) return false;
+
+  size_t len = encode_slots(buf);
+
+  size_t cur_len;
+  const uint8_t* cur = journal_latest(&slots_journal, &cur_len);
+  if (cur != NULL && journal_health(&slots_journal) == ECC_OK &&
+      cur_len == len && memcmp(cur, buf, len) == 0) {
+    return true;
+  }
+
+  return journal_append(&slots_journal, buf, len);
+}
@@ -0,0 +1,102 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+#ifndef PICO_IDENT_SLOTS_H
+#define PICO_IDENT_SLOTS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blob.h"
+#include "journal.h"
+
+/*
+ * Identity slots for the sub-assemblies in a fixture. Each slot has a smaller
+ * set of fields than the device info, and all of the slots are stored together
+ * in their own journal right after the blob regions.
+ */
+#define SLOTS_OFFSET (BLOB_OFFSET + 2 * BLOB_SECTORS * FLASH_SECTOR_SIZE)
+#define SLOTS_SECTORS (2)
+
+#define SLOT_COUNT (32)
+
+/*
+ * The fields in each slot, with their names in commands and their sizes
+ * (including the null terminator). A field's position in this list is part of
+ * its tag in flash, so only add new fields to the end.
+ */
+#define SLOT_FIELDS(X)    \
+  X("PART", part, 32)     \
+  X("SERIAL", serial, 32) \
+  X("NAME", name, 24)     \
+  X("VER", ver, 16)       \
+  X("DATE", date, 12)
+
+/**
+ * @brief Load the slots from flash. This must be called once at boot before
+ * any other slot function.
+ */
+void slots_init(void);
+
+/**
+ * @brief Check whether the slots stored in flash are damaged. Nothing can be
+ * read from damaged slots, and they aren't stored over until slots_clear() is
+ * called, so that nothing is lost without being asked for.
+ *
+ * @return True if the newest record of the slots can't be read.
+ */
+bool slots_damaged(void);
+
+/**
+ * @brief Clear every slot, even if the slots in flash are damaged. As with
+ * slot_set(), the change is only made in RAM until slots_store() is called.
+ */
+void slots_clear(void);
+
+/**
+ * @brief Get the value of a field in a slot.
+ *
+ * @param[in] slot the slot number
+ * @param[in] field the index of the field
+ *
+ * @return The value (null-terminated).
+ */
+const char* slot_get(unsigned slot, int field);
+
+/**
+ * @brief Set the value of a field in a slot. The change is only made in RAM
+ * until slots_store() is called.
+ *
+ * @param[in] slot the slot number
+ * @param[in] field the index of the field
+ * @param[in] value the new value (null-terminated), truncated if it's too long
+ */
+void slot_set(unsigned slot, int field, const char* value);
+
+/**
+ * @brief Find the slots where a field has a given value.
+ *
+ * @param[in] field the index of the field
+ * @param[in] value the value to look for (null-terminated)
+ *
+ * @return A mask with bit n set if slot n matches.
+ */
+uint32_t slot_find(int field, const char* value);
+
+/**
+ * @brief Store the slots in flash. This fails while the slots in flash are
+ * damaged and haven't been cleared.
+ *
+ * @return True if the slots are now stored in flash.
+ */
+bool slots_store(void);
+
+#endif  // PICO_IDENT_SLOTS_H
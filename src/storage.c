@@ -0,0 +1,300 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+#include "storage.h"
+
+#include <string.h>
+
+#include "pico/flash.h"
+#include "pico/stdlib.h"
+
+// Number of times to retry programming or erasing before giving up on a
+// sector.
+#define STORAGE_RETRIES (2)
+
+#define PARTITION_SECTORS (STORAGE_SIZE / FLASH_SECTOR_SIZE)
+#define FIRST_SPARE (STORAGE_SECTORS)
+#define REMAP_SECTOR (PARTITION_SECTORS - 1)
+
+#define PAGE_WORDS (FLASH_PAGE_SIZE / sizeof(uint32_t))
+
+/*
+ * Each entry in the remap table is a word holding the sector being replaced in
+ * the low byte and the sector replacing it in the next byte. The top half is
+ * the complement of the bottom half, so an entry that was only partly
+ * programmed is ignored. Entries are only ever added, so the last one for a
+ * sector wins. A spare that turned out to be bad is recorded as replacing
+ * DEAD_SECTOR, so that it isn't used again.
+ */
+#define REMAP_ENTRIES (FLASH_SECTOR_SIZE / sizeof(uint32_t))
+#define REMAP_EMPTY (0xFFFFFFFFu)
+#define DEAD_SECTOR (0xFF)
+
+_Static_assert(PARTITION_SECTORS < DEAD_SECTOR,
+               "sector numbers must fit in a remap entry");
+
+// Where each sector actually is in the partition.
+static uint8_t map[STORAGE_SECTORS];
+
+// Next spare sector to use, and next unused entry in the remap table.
+static uint32_t next_spare = FIRST_SPARE;
+static uint32_t next_entry = 0;
+
+static struct storage_health stats = {0};
+
+// Arguments for flash_program(), since flash_safe_execute() only passes one.
+struct program_args {
+  uint32_t offset;
+  const uint32_t* data;
+};
+
+/*
+ * These are run through flash_safe_execute(), which disables interrupts and,
+ * if the other core is running, pauses it somewhere it won't touch flash.
+ */
+static void flash_erase(void* param) {
+  flash_range_erase(*(const uint32_t*)param, FLASH_SECTOR_SIZE);
+}
+
+static void flash_program(void* param) {
+  const struct program_args* args = param;
+  flash_range_program(args->offset, (const uint8_t*)args->data,
+                      FLASH_PAGE_SIZE);
+}
+
+static uint32_t sector_offset(uint32_t sector) {
+  return STORAGE_OFFSET + sector * FLASH_SECTOR_SIZE;
+}
+
+static const uint8_t* sector_ptr(uint32_t sector) {
+  return (const uint8_t*)(XIP_BASE + sector_offset(sector));
+}
+
+static bool range_is_erased(const uint8_t* bytes, size_t len) {
+  // Check a byte at a time up to a word boundary, then a word at a time.
+  while (len > 0 && ((uintptr_t)bytes % sizeof(uint32_t)) != 0) {
+    if (*bytes++ != 0xFF) return false;
+    --len;
+  }
+
+  const uint32_t* words = (const uint32_t*)bytes;
+  for (; len >= sizeof(uint32_t); len -= sizeof(uint32_t)) {
+    if (*words++ != 0xFFFFFFFFu) return false;
+  }
+
+  bytes = (const uint8_t*)words;
+  while (len > 0) {
+    if (*bytes++ != 0xFF) return false;
+    --len;
+  }
+
+  return true;
+}
+
+// Erase a sector, retrying until it reads back as erased.
+static bool erase_sector(uint32_t sector) {
+  for (int attempt = 0; attempt <= STORAGE_RETRIES; ++attempt) {
+    if (attempt > 0) ++stats.retries;
+
+    uint32_t offset = sector_offset(sector);
+    if (flash_safe_execute(flash_erase, &offset, UINT32_MAX) == PICO_OK &&
+        range_is_erased(sector_ptr(sector), FLASH_SECTOR_SIZE)) {
+      return true;
+    }
+  }
+
+  ++stats.failures;
+  return false;
+}
+
+// Program a page of a sector, retrying until it reads back as expected. Since
+// programming only clears bits, programming the same data again is harmless.
+static bool program_page(uint32_t sector, uint32_t page, const uint32_t* buf,
+                         const uint32_t* expected) {
+  const uint32_t* words = (const uint32_t*)(sector_ptr(sector) + page);
+
+  for (int attempt = 0; attempt <= STORAGE_RETRIES; ++attempt) {
+    if (attempt > 0) ++stats.retries;
+
+    // Interrupts are disabled for one page at a time.
+    struct program_args args = {sector_offset(sector) + page, buf};
+    if (flash_safe_execute(flash_program, &args, UINT32_MAX) != PICO_OK) {
+      continue;
+    }
+
+    size_t i = 0;
+    while (i < PAGE_WORDS && words[i] == expected[i]) ++i;
+    if (i == PAGE_WORDS) return true;
+  }
+
+  ++stats.failures;
+  return false;
+}
+
+// Add an entry to the remap table. If programming an entry fails, it'll never
+// be valid, so just move on to the next one.
+static bool add_entry(uint32_t from, uint32_t to) {
+  static uint32_t buf[PAGE_WORDS];
+  static uint32_t expected[PAGE_WORDS];
+
+  uint32_t entry = from | (to << 8);
+  entry |= (~entry & 0xFFFFu) << 16;
+
+  while (next_entry < REMAP_ENTRIES) {
+    uint32_t i = next_entry++;
+    uint32_t page = (i * sizeof(uint32_t)) & ~(FLASH_PAGE_SIZE - 1);
+    const uint32_t* cur = (const uint32_t*)(sector_ptr(REMAP_SECTOR) + page);
+
+    memset(buf, 0xFF, sizeof(buf));
+    buf[i % PAGE_WORDS] = entry;
+    for (size_t j = 0; j < PAGE_WORDS; ++j) {
+      expected[j] = cur[j] & buf[j];
+    }
+
+    if (program_page(REMAP_SECTOR, page, buf, expected)) {
+      ++stats.retired;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/*
+ * Replace a sector with the next good spare. If copy is set, the sector's
+ * contents are copied to the spare, except for the page at offset page, which
+ * is replaced with data. The remap entry is added last, so if this is
+ * interrupted, the old sector is still used.
+ */
+static bool replace_sector(uint32_t sector, bool copy, uint32_t page,
+                           const uint32_t* data) {
+  static uint32_t buf[PAGE_WORDS];
+
+  while (next_spare < REMAP_SECTOR) {
+    uint32_t spare = next_spare++;
+    bool ok = erase_sector(spare);
+
+    for (uint32_t p = 0; ok && copy && p < FLASH_SECTOR_SIZE;
+         p += FLASH_PAGE_SIZE) {
+      if (p == page) {
+        memcpy(buf, data, sizeof(buf));
+      } else {
+        memcpy(buf, sector_ptr(map[sector]) + p, sizeof(buf));
+      }
+
+      if (!range_is_erased((const uint8_t*)buf, sizeof(buf))) {
+        ok = program_page(spare, p, buf, buf);
+      }
+    }
+
+    if (ok) {
+      if (!add_entry(sector, spare)) return false;
+      map[sector] = spare;
+      return true;
+    }
+
+    add_entry(DEAD_SECTOR, spare);
+  }
+
+  return false;
+}
+
+void storage_init(void) {
+  for (uint32_t i = 0; i < STORAGE_SECTORS; ++i) {
+    map[i] = i;
+  }
+
+  next_spare = FIRST_SPARE;
+  stats.retired = 0;
+
+  const uint32_t* table = (const uint32_t*)sector_ptr(REMAP_SECTOR);
+  for (next_entry = 0;
+       next_entry < REMAP_ENTRIES && table[next_entry] != REMAP_EMPTY;
+       ++next_entry) {
+    uint32_t entry = table[next_entry];
+    uint32_t from = entry & 0xFFu;
+    uint32_t to = (entry >> 8) & 0xFFu;
+
+    if ((entry >> 16) != (~entry & 0xFFFFu) || to < FIRST_SPARE ||
+        to >= REMAP_SECTOR) {
+      continue;
+    }
+
+    if (to >= next_spare) next_spare = to + 1;
+    if (from < STORAGE_SECTORS) map[from] = to;
+    ++stats.retired;
+  }
+}
+
+const void* storage_ptr(uint32_t offset) {
+  return sector_ptr(map[offset / FLASH_SECTOR_SIZE]) +
+         offset % FLASH_SECTOR_SIZE;
+}
+
+bool storage_is_erased(uint32_t offset, size_t len) {
+  // Check one sector at a time, since they may not be next to each other.
+  while (len > 0) {
+    size_t n = FLASH_SECTOR_SIZE - offset % FLASH_SECTOR_SIZE;
+    if (n > len) n = len;
+
+    if (!range_is_erased(storage_ptr(offset), n)) return false;
+
+    offset += n;
+    len -= n;
+  }
+
+  return true;
+}
+
+bool storage_erase(uint32_t offset) {
+  uint32_t sector = offset / FLASH_SECTOR_SIZE;
+
+  return erase_sector(map[sector]) || replace_sector(sector, false, 0, NULL);
+}
+
+bool storage_program(uint32_t offset, const void* data, size_t len) {
+  static uint32_t buf[PAGE_WORDS];
+  static uint32_t expected[PAGE_WORDS];
+  const uint8_t* src = data;
+
+  while (len > 0) {
+    uint32_t page = offset & ~(FLASH_PAGE_SIZE - 1);
+    size_t pos = offset - page;
+    size_t n = FLASH_PAGE_SIZE - pos;
+    if (n > len) n = len;
+
+    // Any bytes left as FF won't be changed by programming.
+    memset(buf, 0xFF, sizeof(buf));
+    memcpy((uint8_t*)buf + pos, src, n);
+
+    // Programming can only clear bits, so this is what should be read back.
+    const uint32_t* cur = storage_ptr(page);
+    for (size_t i = 0; i < PAGE_WORDS; ++i) {
+      expected[i] = cur[i] & buf[i];
+    }
+
+    uint32_t sector = page / FLASH_SECTOR_SIZE;
+    if (!program_page(map[sector], page % FLASH_SECTOR_SIZE, buf, expected) &&
+        !replace_sector(sector, true, page % FLASH_SECTOR_SIZE, expected)) {
+      return false;
+    }
+
+    offset += n;
+    src += n;
+    len -= n;
+  }
+
+  return true;
+}
+
+void storage_get_health(struct storage_health* health) {
+  *health = stats;
+  health->spares = REMAP_SECTOR - next_spare;
+}
@@ -0,0 +1,141 @@
+/*
+ * Raspberry Pi Pico System Identification Unit (pico-ident)
+ *
+ * Copyright (c) 2022, Bloomy Controls
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the LICENSE
+ * file for the full license terms.
+ */
+
+#ifndef PICO_IDENT_STORAGE_H
+#define PICO_IDENT_STORAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hardware/flash.h"
+
+/*
+ * Size of the storage partition at the end of flash, which holds everything
+ * this firmware stores. This is set by CMake, and the partition is reserved by
+ * the linker (see storage.ld), so the build fails if the program overlaps it.
+ */
+#ifndef STORAGE_SIZE
+#error "STORAGE_SIZE must be defined by the build"
+#endif
+
+_Static_assert(STORAGE_SIZE % FLASH_SECTOR_SIZE == 0,
+               "STORAGE_SIZE must be a whole number of sectors");
+
+// Start of the storage partition, defined by the linker.
+extern const uint8_t __storage_start[];
+
+/*
+ * Offset of the storage partition from the start of flash.
+ */
+#define STORAGE_OFFSET \
+  ((uint32_t)(__storage_start - (const uint8_t*)XIP_BASE))
+
+/*
+ * Number of spare sectors at the end of the partition. When a sector wears out
+ * and can no longer be erased or programmed reliably, it's replaced with one of
+ * these. The last sector of the partition holds the table of replacements.
+ */
+#define STORAGE_SPARE_SECTORS (3)
+
+/*
+ * Number of sectors that can be used through the functions below. Offsets
+ * passed to them are relative to the start of the partition, and are mapped to
+ * wherever that sector actually is in flash.
+ */
+#define STORAGE_SECTORS \
+  (STORAGE_SIZE / FLASH_SECTOR_SIZE - STORAGE_SPARE_SECTORS - 1)
+
+_Static_assert(STORAGE_SECTORS > 0, "STORAGE_SIZE is too small");
+
+/*
+ * Counters describing the health of the flash.
+ */
+struct storage_health {
+  // Number of times programming or erasing had to be retried since boot.
+  uint32_t retries;
+  // Number of times a sector failed even after retrying since boot.
+  uint32_t failures;
+  // Number of sectors that have been retired (including bad spares).
+  uint32_t retired;
+  // Number of spare sectors left.
+  uint32_t spares;
+};
+
+/**
+ * @brief Read the table of replaced sectors. This must be called once at boot
+ * before any other storage function.
+ */
+void storage_init(void);
+
+/**
+ * @brief Get a pointer for reading from the partition.
+ *
+ * Sectors that have been replaced aren't next to each other in flash, so reads
+ * through the pointer must stay within the sector. The pointer is no longer
+ * valid once that sector is erased or programmed.
+ *
+ * @param[in] offset the offset from the start of the partition
+ *
+ * @return A pointer to the data in flash.
+ */
+const void* storage_ptr(uint32_t offset);
+
+/**
+ * @brief Check whether a range of flash is in its erased state (all FFs).
+ *
+ * @param[in] offset the offset of the range from the start of the partition
+ * @param[in] len the length of the range in bytes
+ *
+ * @return True if every byte in the range is erased.
+ */
+bool storage_is_erased(uint32_t offset, size_t len);
+
+/**
+ * @brief Erase a sector of flash.
+ *
+ * The sector is checked afterwards, and if it didn't erase, the erase is
+ * retried. If it still doesn't erase, the sector is replaced with a spare.
+ *
+ * @param[in] offset the offset of the sector from the start of the partition
+ * (must be sector-aligned)
+ *
+ * @return True if the sector is now erased.
+ */
+bool storage_erase(uint32_t offset);
+
+/**
+ * @brief Program data into flash.
+ *
+ * The data doesn't need to be page-aligned. Each page it touches is programmed
+ * with the rest of the page left as FFs, which leaves the bytes already there
+ * alone. Since programming can only clear bits, the target bytes should
+ * normally be erased first.
+ *
+ * Each page is read back after it's programmed, and if it doesn't match, it's
+ * programmed again. If it still doesn't match, the sector is copied to a spare
+ * with the new data, and the spare replaces it.
+ *
+ * @param[in] offset the offset from the start of the partition to program at
+ * @param[in] data the data to program (must not be in flash)
+ * @param[in] len the length of the data in bytes
+ *
+ * @return True if the data was programmed.
+ */
+bool storage_program(uint32_t offset, const void* data, size_t len);
+
+/**
+ * @brief Get the health counters for the flash.
+ *
+ * @param[out] health the structure to fill in
+ */
+void storage_get_health(struct storage_health* health);
+
+#endif  // PICO_IDENT_STORAGE_H